@@ -5,6 +5,12 @@
 #include"Channel.hpp"
 #include"Connection.hpp"
 #include <memory>
+#include <fcntl.h>
+
+//每次可读事件最多接受的连接数
+const int DEFAULT_ACCEPT_BUDGET = 64;
+//描述符耗尽又没有预留描述符可用时，暂停accept的毫秒数
+const uint64_t ACCEPT_PAUSE_MS = 100;
 
 
 //监听连接管理
@@ -17,28 +23,105 @@ class Acceptor {
 
         using AcceptCallback = std::function<void(int)>;
         AcceptCallback _accept_callback;
+
+        bool _edge_triggered;   //边缘触发：一次事件一直accept到EAGAIN
+        int _accept_budget;     //每次可读事件最多接受的连接数
+        int _spare_fd;          //预留的描述符，描述符耗尽时腾出来接受并关闭一个连接
+        bool _paused;           //描述符耗尽暂停了accept
+        bool _stopped;          //已停止监听，排队中的任务不再accept
     private:
         /*监听套接字的读事件回调处理函数---获取新连接，调用_accept_callback函数进行新连接处理*/
+        //一次最多接受_accept_budget个，连接风暴时不必每个连接都经过一次Poll
         void HandleRead() {
-            Socket newfd = _socket.Accept();
-            if (newfd.fd() < 0) {
-                return ;
+            if (_stopped) return ;
+            for (int i = 0; i < _accept_budget; i++) {
+                Socket newfd = _socket.Accept();
+                if (newfd.fd() == -2) {
+                    return ;//已经取完
+                }
+                if (newfd.fd() < 0) {
+                    int err = errno;
+                    if (err == ECONNABORTED || err == EPROTO) {
+                        continue;//对端在accept之前放弃了，继续取下一个
+                    }
+                    if ((err == EMFILE || err == ENFILE) && _spare_fd >= 0) {
+                        if (!ShedOne()) return ;
+                        continue;
+                    }
+                    if (err == EMFILE || err == ENFILE || err == ENOBUFS || err == ENOMEM) {
+                        Pause();
+                    }
+                    return ;
+                }
+                if (_accept_callback) _accept_callback(newfd.Release());
+            }
+            //边缘触发下预算用完还可能有未接受的连接，不会再收到通知，排队稍后继续
+            //水平触发下次Poll会再次报告
+            if (_edge_triggered) {
+                _loop->QueueInLoop([this] { HandleRead(); });
+            }
+        }
+
+        //描述符耗尽：腾出预留的描述符接受一个连接并立即关闭
+        //对端马上得到关闭而不是一直等待，监听套接字也不会因为一直就绪而让循环空转
+        //返回false表示队列中已经没有连接
+        bool ShedOne() {
+            ::close(_spare_fd);
+            int fd = ::accept(_socket.fd(), nullptr, nullptr);
+            if (fd >= 0) {
+                ::close(fd);
+                LOG(WARNING, "too many open files, shed a connection");
             }
-            if (_accept_callback) _accept_callback(newfd.Release());
+            _spare_fd = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+            return fd >= 0;
         }
-        int CreateServer(int port) {
-            bool ret = _socket.BuildListenSocket(port);
+
+        //没有预留描述符可用：停止监控一段时间，期间新连接留在内核队列中
+        void Pause() {
+            if (_paused) return ;
+            LOG(WARNING, "accept paused for %lums: %d(%s)", ACCEPT_PAUSE_MS, errno, strerror(errno));
+            _paused = true;
+            _channel->DisableRead();
+            _loop->RunAfter(ACCEPT_PAUSE_MS, [this] {
+                _paused = false;
+                if (_stopped) return ;
+                if (_spare_fd < 0) _spare_fd = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+                _channel->EnableRead();
+                HandleRead();
+            });
+        }
+
+        int CreateServer(int port, int backlog) {
+            bool ret = _socket.BuildListenSocket(port, backlog);
             assert(ret == true);
             return _socket.fd();
         }
     public:
         /*不能将启动读事件监控，放到构造函数中，必须在设置回调函数后，再去启动*/
         /*否则有可能造成启动监控后，立即有事件，处理的时候，回调函数还没设置：新连接得不到处理，且资源泄漏*/
-        Acceptor(EventLoop *loop, int port): _socket(CreateServer(port)), _loop(loop)
+        Acceptor(EventLoop *loop, int port, int backlog = DEFAULT_BACKLOG):
+            _socket(CreateServer(port, backlog)), _loop(loop), _edge_triggered(false),
+            _accept_budget(DEFAULT_ACCEPT_BUDGET), _paused(false), _stopped(false)
         {
+            _spare_fd = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
             _channel = std::make_unique<Channel>(_socket.fd(),_loop);
             _channel->SetReadCallback(std::bind(&Acceptor::HandleRead, this));
         }
+        ~Acceptor()
+        {
+            if (_spare_fd >= 0) ::close(_spare_fd);
+        }
         void SetAcceptCallback(const AcceptCallback &cb) { _accept_callback = cb; }
+        void SetAcceptBudget(int budget) { _accept_budget = budget < 1 ? 1 : budget; }
         void Listen() { _channel->EnableRead(); }
+        void SetEdgeTriggered(bool on) { _edge_triggered = on; _channel->SetEdgeTriggered(on); }
+        void SetIncomingCpu(int cpu) { _socket.SetIncomingCpu(cpu); }
+        //在所属loop线程中停止监听并关闭监听套接字；对象要等loop线程退出后再销毁
+        //SO_REUSEPORT下已经进入本套接字队列、还没accept的连接会被内核重置
+        void Stop() {
+            if (_stopped) return ;
+            _stopped = true;
+            _channel->Remove();
+            _socket.Close();
+        }
 };
\ No newline at end of file
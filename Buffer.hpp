@@ -2,9 +2,12 @@
 #include <cassert>
 #include <string>
 #include <sys/types.h>
-#include<vector>
+#include <sys/uio.h>
+#include <cerrno>
 #include<cstring>
 #include<cstdint>
+#include<algorithm>
+#include "BufferPool.hpp"
 /*
     服务器缓冲区模块
     存取数据
@@ -16,13 +19,13 @@ const uint64_t BUFFER_DEFAULT_SIZE = 1024;
 class Buffer
 {
 public:
-    char* Begin() {return &*_buffer.begin();}
+    char* Begin() {return _data;}
     //获取写入位置
     char* WritePosition() {return Begin() + _writeIndex;}
     //获取读取位置
     char* ReadPosition() {return Begin() + _readIndex;}
     //获取缓冲区末尾空闲空间大小
-    uint64_t TailIdleSize() {return _buffer.size() - _writeIndex;}
+    uint64_t TailIdleSize() {return _capacity - _writeIndex;}
     //获取缓冲区起始空间大小
     uint64_t HeadIdleSize() {return _readIndex;}
     //获取可读数据大小
@@ -44,13 +47,20 @@ public:
 
     char* FindCRLF()
     {
+        if(ReadAbleSize() == 0) return nullptr;
         char* res = (char*)memchr(ReadPosition(),'\n',ReadAbleSize());
         return res;
     }
 
 
 public:
-    Buffer():_readIndex(0), _writeIndex(0), _buffer(BUFFER_DEFAULT_SIZE) {}
+    //存储空间在第一次写入时才申请；指定了内存池则从内存池申请
+    explicit Buffer(BufferPool* pool = nullptr)
+        :_pool(pool), _data(nullptr), _capacity(0), _readIndex(0), _writeIndex(0) {}
+    Buffer(const Buffer&) = delete;
+    Buffer& operator=(const Buffer&) = delete;
+    ~Buffer() { Release(); }
+
     //确保可写空间足够
     void EnsureWriteSpace(uint64_t len)
     {
@@ -68,28 +78,27 @@ public:
         }
         else  
         {
-            //扩容
-            //先将数据整体移动到最前面
-            // uint64_t readable = ReadAbleSize();
-            // std::memmove(Begin(),ReadPosition(),readable);
-            // _readIndex = 0;
-            // _writeIndex = readable;
-            // //扩容
-            // uint64_t newCapacity = _buffer.size() * 2;
-            // while(newCapacity < _writeIndex + len)
-            // {
-            //     newCapacity *= 2;
-            // }
-            // _buffer.resize(newCapacity);
-
-            //不移动数据直接扩容
-            _buffer.resize(_writeIndex + len);
+            //扩容：申请更大的块，只拷贝可读数据到新块起始位置，按倍数增长
+            uint64_t readable = ReadAbleSize();
+            uint64_t want = std::max(readable + len, std::max(_capacity * 2, BUFFER_DEFAULT_SIZE));
+            uint64_t capacity;
+            char* data = AllocBlock(want, &capacity);
+            if(readable > 0)
+            {
+                std::memcpy(data, ReadPosition(), readable);
+            }
+            FreeBlock(_data, _capacity);
+            _data = data;
+            _capacity = capacity;
+            _readIndex = 0;
+            _writeIndex = readable;
         }
     }
 
     //写入数据
     bool Write(const void* data, uint64_t len)
     {
+        if(len == 0) return true;
         EnsureWriteSpace(len);
         void * p = std::memcpy(WritePosition(),data,len);
         if(p == nullptr)
@@ -147,14 +156,92 @@ public:
     }
 
 
+    //从描述符读取数据，直接读入尾部空闲空间，放不下的部分落到extra中再追加
+    //readv一次系统调用同时填充两段，绝大多数情况下数据只拷贝一次
+    //返回值: >0 读到的字节数  =0 对端关闭  =-1 错误  =-2 可重试(EAGAIN)
+    ssize_t ReadFd(int fd, char* extra, uint64_t extralen)
+    {
+        if(_capacity == 0)
+        {
+            EnsureWriteSpace(BUFFER_DEFAULT_SIZE);
+        }
+        uint64_t writable = TailIdleSize();
+        struct iovec vec[2];
+        vec[0].iov_base = WritePosition();
+        vec[0].iov_len = writable;
+        vec[1].iov_base = extra;
+        vec[1].iov_len = extralen;
+        //尾部空间已经比溢出区大时，没有必要再使用溢出区
+        int iovcnt = (writable < extralen) ? 2 : 1;
+
+        ssize_t n;
+        do {
+            n = ::readv(fd, vec, iovcnt);
+        } while(n < 0 && errno == EINTR);
+        if(n < 0)
+        {
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? -2 : -1;
+        }
+
+        if(static_cast<uint64_t>(n) <= writable)
+        {
+            MoveWriteOffset(n);
+        }
+        else
+        {
+            MoveWriteOffset(writable);
+            Write(extra, n - writable);
+        }
+        return n;
+    }
+
     //清空缓冲区
     void Clear()
     {
         _readIndex = _writeIndex = 0;
     }
 
+    //清空并归还存储空间
+    void Release()
+    {
+        FreeBlock(_data, _capacity);
+        _data = nullptr;
+        _capacity = 0;
+        _readIndex = _writeIndex = 0;
+    }
+
+    //改换内存池：只能在没有存储时调用，之后申请的存储来自新的内存池
+    void SetPool(BufferPool* pool)
+    {
+        assert(_data == nullptr);
+        _pool = pool;
+    }
+
 private:
-    std::vector<char> _buffer;
+    char* AllocBlock(uint64_t size, uint64_t* capacity)
+    {
+        if(_pool)
+        {
+            *capacity = BufferPool::BlockSize(size);
+            return static_cast<char*>(_pool->Allocate(*capacity));
+        }
+        *capacity = size;
+        return static_cast<char*>(::operator new(size));
+    }
+
+    void FreeBlock(char* data, uint64_t capacity)
+    {
+        if(data == nullptr) return;
+        if(_pool)
+        {
+            return _pool->Deallocate(data, capacity);
+        }
+        ::operator delete(data);
+    }
+
+    BufferPool* _pool;
+    char* _data;
+    uint64_t _capacity;
     uint64_t _readIndex;
     uint64_t _writeIndex;
 };
\ No newline at end of file
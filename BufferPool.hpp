@@ -0,0 +1,227 @@
+#pragma once
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <vector>
+#include <algorithm>
+#include <sys/mman.h>
+/*
+    缓冲区内存池模块
+    按大小分级(1K~64K，2的幂)，每一级从整块slab中切分固定大小的内存块
+    空闲块挂在所属slab的空闲链表上复用，连接建立和释放不再经过全局分配器
+    空闲内存超过上限时，整块都空闲的slab随即归还系统，突发流量过后不会一直停在峰值
+    超过最大级别的申请直接交给系统
+    每个EventLoop一个，只能在所属EventLoop线程中使用
+*/
+const size_t POOL_MIN_BLOCK_SHIFT = 10;                 //最小块 1K
+const size_t POOL_CLASS_COUNT = 7;                      //1K 2K 4K 8K 16K 32K 64K
+const size_t POOL_MAX_BLOCK_SIZE = (size_t)1 << (POOL_MIN_BLOCK_SHIFT + POOL_CLASS_COUNT - 1);
+const size_t POOL_SLAB_SIZE = 256 * 1024;               //普通slab大小
+const size_t POOL_HUGE_SLAB_SIZE = 2 * 1024 * 1024;     //大页slab大小
+const size_t POOL_MAX_FREE_BYTES = 4 * 1024 * 1024;     //空闲内存上限，超过时归还整块空闲的slab
+
+class BufferPool
+{
+private:
+    struct FreeBlock
+    {
+        FreeBlock* _next;
+    };
+
+    struct Slab
+    {
+        char* _base;
+        size_t _size;
+        size_t _class;      //切分给哪一级
+        size_t _used;       //已分配出去的块数
+        FreeBlock* _free;
+        Slab* _prev;        //所在级别有空闲块的slab链表
+        Slab* _next;
+    };
+
+    Slab* _partial[POOL_CLASS_COUNT];   //各级还有空闲块的slab
+    std::vector<Slab*> _slabs;          //向系统申请的整块内存，按地址排序
+    bool _hugepage;
+    size_t _freeBytes;                  //所有slab中空闲块的总字节数
+
+    //申请大小对应的级别
+    static size_t ClassIndex(size_t size)
+    {
+        size_t idx = 0;
+        size_t block = (size_t)1 << POOL_MIN_BLOCK_SHIFT;
+        while(block < size)
+        {
+            block <<= 1;
+            idx++;
+        }
+        return idx;
+    }
+
+    static size_t ClassSize(size_t idx)
+    {
+        return (size_t)1 << (POOL_MIN_BLOCK_SHIFT + idx);
+    }
+
+    //向系统申请一块slab，开启大页时优先使用hugetlb，失败则退回普通页并提示内核透明大页
+    char* MapSlab(size_t* size)
+    {
+        void* p = MAP_FAILED;
+        if(_hugepage)
+        {
+            *size = POOL_HUGE_SLAB_SIZE;
+#ifdef MAP_HUGETLB
+            p = ::mmap(nullptr, *size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+            if(p == MAP_FAILED)
+            {
+                p = ::mmap(nullptr, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#ifdef MADV_HUGEPAGE
+                if(p != MAP_FAILED) ::madvise(p, *size, MADV_HUGEPAGE);
+#endif
+            }
+        }
+        else
+        {
+            *size = POOL_SLAB_SIZE;
+            p = ::mmap(nullptr, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        }
+        if(p == MAP_FAILED)
+        {
+            throw std::bad_alloc();
+        }
+        return static_cast<char*>(p);
+    }
+
+    void LinkPartial(Slab* slab)
+    {
+        Slab*& head = _partial[slab->_class];
+        slab->_prev = nullptr;
+        slab->_next = head;
+        if(head != nullptr) head->_prev = slab;
+        head = slab;
+    }
+
+    void UnlinkPartial(Slab* slab)
+    {
+        if(slab->_prev != nullptr) slab->_prev->_next = slab->_next;
+        else _partial[slab->_class] = slab->_next;
+        if(slab->_next != nullptr) slab->_next->_prev = slab->_prev;
+    }
+
+    //为某一级补充空闲块：切分一整块slab
+    void Refill(size_t idx)
+    {
+        Slab* slab = new Slab();
+        slab->_base = MapSlab(&slab->_size);
+        slab->_class = idx;
+        slab->_used = 0;
+        slab->_free = nullptr;
+        size_t block = ClassSize(idx);
+        for(size_t off = slab->_size; off >= block; off -= block)
+        {
+            FreeBlock* fb = reinterpret_cast<FreeBlock*>(slab->_base + off - block);
+            fb->_next = slab->_free;
+            slab->_free = fb;
+        }
+        _freeBytes += slab->_size;
+        _slabs.insert(std::upper_bound(_slabs.begin(), _slabs.end(), slab, ByBase), slab);
+        LinkPartial(slab);
+    }
+
+    //整块空闲的slab归还系统
+    void Release(Slab* slab)
+    {
+        UnlinkPartial(slab);
+        _slabs.erase(std::lower_bound(_slabs.begin(), _slabs.end(), slab, ByBase));
+        _freeBytes -= slab->_size;
+        ::munmap(slab->_base, slab->_size);
+        delete slab;
+    }
+
+    static bool ByBase(const Slab* a, const Slab* b) { return a->_base < b->_base; }
+
+    //块所属的slab：起始地址不大于它的最后一块
+    Slab* SlabOf(void* p) const
+    {
+        auto it = std::upper_bound(_slabs.begin(), _slabs.end(), static_cast<char*>(p),
+                                   [](char* addr, const Slab* slab) { return addr < slab->_base; });
+        assert(it != _slabs.begin());
+        return *(it - 1);
+    }
+
+public:
+    BufferPool():_hugepage(false), _freeBytes(0)
+    {
+        for(size_t i = 0; i < POOL_CLASS_COUNT; i++)
+        {
+            _partial[i] = nullptr;
+        }
+    }
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    ~BufferPool()
+    {
+        for(Slab* slab : _slabs)
+        {
+            ::munmap(slab->_base, slab->_size);
+            delete slab;
+        }
+    }
+
+    //开启大页：只影响之后新申请的slab
+    void EnableHugePage(bool on = true) { _hugepage = on; }
+
+    //实际分配的块大小：池内为所属级别大小，超过最大级别时为原始大小
+    static size_t BlockSize(size_t size)
+    {
+        if(size > POOL_MAX_BLOCK_SIZE) return size;
+        return ClassSize(ClassIndex(size));
+    }
+
+    //申请内存，size必须是BlockSize()返回的大小，归还时传入同样的大小
+    void* Allocate(size_t size)
+    {
+        assert(size > 0);
+        if(size > POOL_MAX_BLOCK_SIZE)
+        {
+            return ::operator new(size);
+        }
+        size_t idx = ClassIndex(size);
+        if(_partial[idx] == nullptr)
+        {
+            Refill(idx);
+        }
+        Slab* slab = _partial[idx];
+        FreeBlock* fb = slab->_free;
+        slab->_free = fb->_next;
+        slab->_used++;
+        if(slab->_free == nullptr) UnlinkPartial(slab);
+        _freeBytes -= ClassSize(idx);
+        return fb;
+    }
+
+    void Deallocate(void* p, size_t size)
+    {
+        if(p == nullptr) return;
+        if(size > POOL_MAX_BLOCK_SIZE)
+        {
+            ::operator delete(p);
+            return;
+        }
+        Slab* slab = SlabOf(p);
+        assert(slab->_class == ClassIndex(size));
+        FreeBlock* fb = static_cast<FreeBlock*>(p);
+        if(slab->_free == nullptr) LinkPartial(slab);
+        fb->_next = slab->_free;
+        slab->_free = fb;
+        slab->_used--;
+        _freeBytes += ClassSize(slab->_class);
+        if(slab->_used == 0 && _freeBytes > POOL_MAX_FREE_BYTES)
+        {
+            Release(slab);
+        }
+    }
+};
@@ -0,0 +1,229 @@
+#pragma once
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <new>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "BufferPool.hpp"
+/*
+    分段缓冲区模块
+    由固定大小的数据块串成链表，数据块来自所属EventLoop的内存池
+    追加数据不需要扩容和整体搬移
+    发送时每个块对应一个iovec，一次writev发出
+    文件区间可以和内存数据按顺序排队，发送时由sendfile从页缓存直接送入套接字
+*/
+//数据块连同头部恰好占用内存池中一个4K块
+const uint64_t BUFFER_CHUNK_SIZE = 4096 - 4 * sizeof(uint32_t);
+
+struct BufferChunk
+{
+    uint32_t _readIndex;
+    uint32_t _writeIndex;
+    uint32_t _pins;         //以零拷贝方式发出、内核尚未用完的次数
+    uint32_t _detached;     //已经从缓冲区中移除，等待解除引用后归还内存池
+    char _data[BUFFER_CHUNK_SIZE];
+
+    uint64_t ReadAbleSize() const { return _writeIndex - _readIndex; }
+    uint64_t TailIdleSize() const { return BUFFER_CHUNK_SIZE - _writeIndex; }
+};
+
+//缓冲区中的一段：内存数据块，或者一段待发送的文件区间
+struct ChainSegment
+{
+    BufferChunk* _chunk;    //内存数据块，文件段为nullptr
+    int _fd;                //文件描述符，由缓冲区负责关闭
+    off_t _offset;          //文件段下一个待发送的偏移
+    uint64_t _len;          //文件段剩余长度
+
+    bool IsFile() const { return _chunk == nullptr; }
+    uint64_t ReadAbleSize() const { return IsFile() ? _len : _chunk->ReadAbleSize(); }
+};
+
+class ChainBuffer
+{
+public:
+    explicit ChainBuffer(BufferPool* pool):_pool(pool), _head(0), _readable(0) {}
+    ChainBuffer(const ChainBuffer&) = delete;
+    ChainBuffer& operator=(const ChainBuffer&) = delete;
+    ~ChainBuffer() { Clear(); }
+
+    //获取可读数据大小(包括文件段)
+    uint64_t ReadAbleSize() const { return _readable; }
+
+    //写入数据：先填满最后一个块的尾部，剩余部分依次放入新块
+    bool Write(const void* data, uint64_t len)
+    {
+        const char* src = static_cast<const char*>(data);
+        while(len > 0)
+        {
+            if(Empty() || _segs.back().IsFile() || _segs.back()._chunk->TailIdleSize() == 0)
+            {
+                PushSegment(ChainSegment{GetChunk(), -1, 0, 0});
+            }
+            BufferChunk* chunk = _segs.back()._chunk;
+            uint64_t n = std::min(len, chunk->TailIdleSize());
+            std::memcpy(chunk->_data + chunk->_writeIndex, src, n);
+            chunk->_writeIndex += n;
+            _readable += n;
+            src += n;
+            len -= n;
+        }
+        return true;
+    }
+
+    //追加一段文件区间，按顺序排在已有数据之后；fd的所有权转移给缓冲区
+    void WriteFile(int fd, off_t offset, uint64_t len)
+    {
+        if(len == 0)
+        {
+            ::close(fd);
+            return ;
+        }
+        PushSegment(ChainSegment{nullptr, fd, offset, len});
+        _readable += len;
+    }
+
+    //队首是否是文件段
+    bool FrontIsFile() const { return !Empty() && _segs[_head].IsFile(); }
+
+    //队首文件段，调用前需确认FrontIsFile()
+    ChainSegment& FrontFile() { return _segs[_head]; }
+
+    //将读偏移向后移动，读完的块归还内存池，发完的文件段关闭描述符
+    void MoveReadOffset(uint64_t len)
+    {
+        if(len == 0) return ;
+        assert(len <= ReadAbleSize());
+        _readable -= len;
+        while(len > 0)
+        {
+            ChainSegment& seg = _segs[_head];
+            uint64_t n = std::min(len, seg.ReadAbleSize());
+            if(seg.IsFile())
+            {
+                seg._offset += n;
+                seg._len -= n;
+            }
+            else
+            {
+                seg._chunk->_readIndex += n;
+            }
+            len -= n;
+            if(seg.ReadAbleSize() == 0)
+            {
+                ReleaseSegment(seg);
+                PopSegment();
+            }
+        }
+    }
+
+    //将队首连续的内存数据块填入iovec数组，遇到文件段停止，返回填充的个数
+    //chunks不为空时同时记录每个iovec对应的数据块
+    int FillIovec(struct iovec* iov, int maxcnt, BufferChunk** chunks = nullptr) const
+    {
+        int cnt = 0;
+        for(auto it = _segs.begin() + _head; it != _segs.end() && cnt < maxcnt; ++it)
+        {
+            if(it->IsFile()) break;
+            BufferChunk* chunk = it->_chunk;
+            if(chunk->ReadAbleSize() == 0) continue;
+            iov[cnt].iov_base = chunk->_data + chunk->_readIndex;
+            iov[cnt].iov_len = chunk->ReadAbleSize();
+            if(chunks) chunks[cnt] = chunk;
+            cnt++;
+        }
+        return cnt;
+    }
+
+    //零拷贝发送后内核仍引用数据块：引用期间即使数据已发完也不能归还内存池
+    void Pin(BufferChunk* chunk)
+    {
+        chunk->_pins++;
+    }
+
+    //内核用完数据块：解除引用，已经移出缓冲区的块归还内存池
+    void Unpin(BufferChunk* chunk)
+    {
+        assert(chunk->_pins > 0);
+        if(--chunk->_pins == 0 && chunk->_detached)
+        {
+            _pool->Deallocate(chunk, sizeof(BufferChunk));
+        }
+    }
+
+    //清空缓冲区，所有块归还内存池，文件段关闭描述符
+    void Clear()
+    {
+        for(size_t i = _head; i < _segs.size(); i++)
+        {
+            ReleaseSegment(_segs[i]);
+        }
+        _segs.clear();
+        _head = 0;
+        _readable = 0;
+    }
+
+    //改换内存池：只能在清空且没有被零拷贝引用的块时调用
+    void SetPool(BufferPool* pool)
+    {
+        assert(Empty());
+        _pool = pool;
+    }
+
+private:
+    //段队列用数组加队首下标，空缓冲区不占用堆内存(std::deque构造时就要分配)
+    bool Empty() const { return _head == _segs.size(); }
+
+    void PushSegment(const ChainSegment& seg)
+    {
+        //数组已满时先挪掉队首已经发完的部分
+        if(_head > 0 && _segs.size() == _segs.capacity())
+        {
+            _segs.erase(_segs.begin(), _segs.begin() + _head);
+            _head = 0;
+        }
+        _segs.push_back(seg);
+    }
+
+    void PopSegment()
+    {
+        if(++_head == _segs.size())
+        {
+            _segs.clear();
+            _head = 0;
+        }
+    }
+
+    //数据块从内存池中申请，读完即归还
+    BufferChunk* GetChunk()
+    {
+        BufferChunk* chunk = new (_pool->Allocate(sizeof(BufferChunk))) BufferChunk;
+        chunk->_readIndex = chunk->_writeIndex = 0;
+        chunk->_pins = chunk->_detached = 0;
+        return chunk;
+    }
+
+    void ReleaseSegment(ChainSegment& seg)
+    {
+        if(seg.IsFile())
+        {
+            ::close(seg._fd);
+            return ;
+        }
+        if(seg._chunk->_pins > 0)
+        {
+            seg._chunk->_detached = 1;//内核还在引用，等Unpin时再归还
+            return ;
+        }
+        _pool->Deallocate(seg._chunk, sizeof(BufferChunk));
+    }
+
+    BufferPool* _pool;
+    std::vector<ChainSegment> _segs;
+    size_t _head;           //队首段的下标
+    uint64_t _readable;
+};
@@ -1,35 +1,67 @@
 #pragma once
 #include <functional>
+#include <memory>
 #include <sys/epoll.h>
 class Poller;
 class EventLoop;
+
+//事件处理接口：连接这类数量大的对象直接实现，Channel只保存一个指针
+class ChannelHandler {
+public:
+    virtual ~ChannelHandler() {}
+    virtual void HandleRead() = 0;
+    virtual void HandleWrite() = 0;
+    virtual void HandleClose() = 0;
+    virtual void HandleError() = 0;
+    //任意事件处理完之后调用
+    virtual void HandleEvent() {}
+    //EPOLLERR时先调用，返回true表示只是错误队列中的通知(如零拷贝完成)，不是套接字错误
+    virtual bool HandleErrQueue() { return false; }
+};
+
 class Channel {
 public:
     using EventCallback = std::function<void()>;
 
     Channel(int fd,EventLoop* loop)
-        : _loop(loop),_fd(fd), _events(0), _revents(0), _closing(false){}
+        : _loop(loop),_fd(fd), _events(0), _revents(0), _edge_triggered(false), _handler(nullptr), _closing(false), _tied(false),
+          _dirty(false), _registered(false), _rearm(false), _applied(0){}
 
     int Fd() const { return _fd; }
 
     bool ReadAble() { return _events & EPOLLIN; }
     bool WriteAble() { return _events & EPOLLOUT; }
 
-    void EnableRead()  { _events |= EPOLLIN; Update(); }
-    void EnableWrite() { _events |= EPOLLOUT; Update(); }
+    void EnableRead()  { Arm(EPOLLIN); }
+    void EnableWrite() { Arm(EPOLLOUT); }
     void DisableRead() { _events &= ~EPOLLIN; Update(); }
     void DisableWrite(){ _events &= ~EPOLLOUT; Update(); }
     void DisableAll()  { _events = 0; Update(); }
 
-    void SetReadCallback(EventCallback cb)  { _readCallback = std::move(cb); }
-    void SetWriteCallback(EventCallback cb) { _writeCallback = std::move(cb); }
-    void SetCloseCallback(EventCallback cb) { _closeCallback = std::move(cb); }
-    void SetErrorCallback(EventCallback cb) { _errorCallback = std::move(cb); }
-    void SetEventCallback(EventCallback cb) { _eventCallback = std::move(cb); }
+    //边缘触发：就绪后只通知一次，处理方需要一直读写到EAGAIN
+    //与读写兴趣分开保存，DisableAll之后重新开启仍是边缘触发
+    void SetEdgeTriggered(bool on)
+    {
+        _edge_triggered = on;
+        if (_events & (EPOLLIN | EPOLLOUT)) Update();
+    }
+    bool EdgeTriggered() { return _edge_triggered; }
+
+    //设置事件处理对象，不转移所有权
+    void SetHandler(ChannelHandler* handler) { _handler = handler; }
+
+    //回调方式：用于少量的内部描述符(eventfd、timerfd、监听套接字)，第一次设置时才分配回调存储
+    void SetReadCallback(EventCallback cb)  { Callbacks()->_read = std::move(cb); }
+    void SetWriteCallback(EventCallback cb) { Callbacks()->_write = std::move(cb); }
+    void SetCloseCallback(EventCallback cb) { Callbacks()->_close = std::move(cb); }
+    void SetErrorCallback(EventCallback cb) { Callbacks()->_error = std::move(cb); }
+    void SetEventCallback(EventCallback cb) { Callbacks()->_event = std::move(cb); }
 
     void SetRevents(uint32_t revents) { _revents = revents; }
 
     EventLoop* OwnerLoop() const { return _loop; }
+    //改换所属loop：只能在从原loop移除之后、注册到新loop之前调用
+    void SetLoop(EventLoop* loop) { _loop = loop; }
 
     bool MarkClosing()
     {
@@ -38,43 +70,115 @@ public:
         return true;
     }
 
+    //绑定所属对象，事件处理期间持有其引用
+    void Tie(const std::shared_ptr<void>& obj)
+    {
+        _tie = obj;
+        _tied = true;
+    }
+
     void HandleEvent()
     {
+        std::shared_ptr<void> guard;
+        if (_tied) {
+            guard = _tie.lock();
+            if (!guard) return;//所属对象已经释放
+        }
+        if (_handler == nullptr) return;
+        if ((_revents & EPOLLERR) && _handler->HandleErrQueue()) {
+            _revents &= ~EPOLLERR;
+        }
         if ((_revents & EPOLLIN) || (_revents & EPOLLRDHUP) || (_revents & EPOLLPRI)) {
             /*不管任何事件，都调用的回调函数*/
-            if (_readCallback) _readCallback();
+            _handler->HandleRead();
         }
         /*有可能会释放连接的操作事件，一次只处理一个*/
         if (_revents & EPOLLOUT) {
-            if (_writeCallback) _writeCallback();
+            _handler->HandleWrite();
         }else if (_revents & EPOLLERR) {
-            if (_errorCallback) _errorCallback();//一旦出错，就会释放连接，因此要放到前边调用任意回调
+            _handler->HandleError();//一旦出错，就会释放连接，因此要放到前边调用任意回调
         }else if (_revents & EPOLLHUP) {
-            if (_closeCallback) _closeCallback();
+            _handler->HandleClose();
         }
-        if (_eventCallback) _eventCallback();
+        _handler->HandleEvent();
     }
 
-    uint32_t Events()
+    //提交给内核的事件：读写兴趣加上触发方式
+    uint32_t Events() const
     {
-        return _events;
+        return _edge_triggered ? (_events | EPOLLET) : _events;
     }
 
     void Remove();
 
+    //记录兴趣变更，由EventLoop在下一次Poll之前统一提交
     void Update();
 
+    //以下由EventLoop维护：是否在待提交列表中，以及内核中已生效的事件
+    bool MarkDirty()
+    {
+        if (_dirty) return false;
+        _dirty = true;
+        return true;
+    }
+    bool Dirty() const { return _dirty; }
+    void ClearDirty() { _dirty = false; }
+    //与内核中的注册状态比较，只有净变化才需要提交；边缘触发下重新开启过的事件总要提交
+    bool NeedSync() const { return _registered ? (Events() != _applied || _rearm) : _events != 0; }
+    void Synced() { _registered = true; _applied = Events(); _rearm = false; }
+    void Unregistered() { _registered = false; _applied = 0; _rearm = false; }
+
 private:
+    //边缘触发下关闭期间到来的就绪不会再产生边缘，同一轮先关后开净变化为零也要重新MOD
+    //MOD时内核重新检查就绪状态，已经在缓冲区里的数据会再通知一次
+    void Arm(uint32_t ev)
+    {
+        if (_edge_triggered && !(_events & ev)) _rearm = true;
+        _events |= ev;
+        Update();
+    }
+
+    //把回调适配成事件处理接口
+    struct CallbackHandler : public ChannelHandler
+    {
+        EventCallback _read;
+        EventCallback _write;
+        EventCallback _close;
+        EventCallback _error;
+        EventCallback _event;
+
+        void HandleRead() override { if (_read) _read(); }
+        void HandleWrite() override { if (_write) _write(); }
+        void HandleClose() override { if (_close) _close(); }
+        void HandleError() override { if (_error) _error(); }
+        void HandleEvent() override { if (_event) _event(); }
+    };
+
+    CallbackHandler* Callbacks()
+    {
+        if (!_callbacks) {
+            _callbacks = std::make_unique<CallbackHandler>();
+            _handler = _callbacks.get();
+        }
+        return _callbacks.get();
+    }
+
     EventLoop* _loop;
     int _fd;
-    uint32_t _events;
+    uint32_t _events;   //读写兴趣
     uint32_t _revents;
+    bool _edge_triggered;
 
-    EventCallback _readCallback;
-    EventCallback _writeCallback;
-    EventCallback _closeCallback;
-    EventCallback _errorCallback;
-    EventCallback _eventCallback;
+    ChannelHandler* _handler;
+    std::unique_ptr<CallbackHandler> _callbacks;
     bool _closing;
+
+    std::weak_ptr<void> _tie;
+    bool _tied;
+
+    bool _dirty;
+    bool _registered;
+    bool _rearm;        //边缘触发下有事件重新开启，需要MOD重新检查就绪
+    uint32_t _applied;
 };
 
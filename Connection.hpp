@@ -1,12 +1,17 @@
 #pragma once
 #include"Buffer.hpp"
+#include"ChainBuffer.hpp"
 #include "Channel.hpp"
 #include"Socket.hpp"
 #include"EventLoop.hpp"
 #include <cassert>
 #include <cstdint>
+#include <climits>
 #include<any>
+#include<atomic>
+#include<fcntl.h>
 #include<memory>
+#include<vector>
 
 //對通信連接的所有操作管理
 /*
@@ -17,6 +22,12 @@
 5.協議上下文管理
 */
 
+//边缘触发模式下每次事件最多读写的字节数，用完后让出给其他连接
+const size_t DEFAULT_IO_BUDGET = 1024 * 1024;
+//迁移时连接还有数据待发送，每隔多少毫秒重试一次，最多等待多少毫秒
+const uint64_t MIGRATE_RETRY_MS = 10;
+const uint64_t MIGRATE_TIMEOUT_MS = 1000;
+
 typedef enum{
     DISCONECTED,
     CONNECTING,
@@ -29,7 +40,7 @@ class Connection;
 
 
 
-class Connection:public std::enable_shared_from_this<Connection>
+class Connection:public ChannelHandler, public std::enable_shared_from_this<Connection>
 {
 public:
     using PtrConnection = std::shared_ptr<Connection>;
@@ -37,22 +48,47 @@ public:
     using MessageCallback = std::function<void(PtrConnection&, Buffer*)>;
     using ClosedCallback = std::function<void(PtrConnection&)>;
     using AnyEventCallback = std::function<void(PtrConnection&)>;
+    using WaterMarkCallback = std::function<void(PtrConnection&, size_t)>;
+    using MigrateCallback = std::function<void(PtrConnection&, bool)>;
+
+    //连接回调：同一服务器的连接共用一份，单个连接修改时才复制
+    struct Callbacks
+    {
+        ConnectedCallback _connected_cb;
+        MessageCallback _message_cb;
+        ClosedCallback _closed_cb;
+        AnyEventCallback _any_event_cb;
+        ClosedCallback _server_closed_cb;   //组件内连接关闭回调
+        WaterMarkCallback _high_water_cb;
+        WaterMarkCallback _low_water_cb;
+    };
+    using PtrCallbacks = std::shared_ptr<Callbacks>;
 public:
     Connection(EventLoop* loop,uint64_t conn_id,int sockfd)
-        : _conn_id(conn_id),
+        : _loop_ref(loop),
+          _conn_id(conn_id),
           _sock(sockfd),
           _enable_inactive_release(false),
           _loop(loop),
-          _timer_id(0),
+          _home(loop),
+          _posting(0),
+          _flush_pending(false),
+          _high_water_mark(0),
+          _low_water_mark(0),
+          _above_high_water(false),
+          _read_paused(false),
+          _edge_triggered(false),
+          _io_budget(DEFAULT_IO_BUDGET),
+          _zerocopy_threshold(0),
+          _zerocopy_next_id(0),
           _channel(sockfd, loop),
-          _state(CONNECTING)
+          _state(CONNECTING),
+          _in_buffer(loop->GetBufferPool()),
+          _out_buffer(loop->GetBufferPool()),
+          _cbs(EmptyCallbacks())
     {
-        //设置事件回调
-        _channel.SetReadCallback(std::bind(&Connection::HandleRead, this));
-        _channel.SetWriteCallback(std::bind(&Connection::HandleWrite, this));
-        _channel.SetCloseCallback(std::bind(&Connection::HandleClose, this));
-        _channel.SetErrorCallback(std::bind(&Connection::HandleError, this));
-        _channel.SetEventCallback(std::bind(&Connection::HandleEvent, this));
+        //设置事件处理
+        _channel.SetHandler(this);
     }
     ~Connection()
     {
@@ -69,6 +105,19 @@ public:
         return _conn_id;
     }
 
+    //当前所属的事件循环，迁移后改变
+    EventLoop* GetLoop() const
+    {
+        return Loop();
+    }
+
+    //正在执行本连接事件处理的循环：迁移期间直到从原线程摘下之前仍是原循环
+    //连接回调中要找本连接所在的循环时用它，GetLoop在迁移开始时就已指向新循环
+    EventLoop* OwnerLoop() const
+    {
+        return _channel.OwnerLoop();
+    }
+
     bool  Connected()
     {
         return _state == CONNECTED;
@@ -85,31 +134,75 @@ public:
         return &_context;
     }
 
+    //整体设置共享的回调，需在Established之前设置
+    void SetCallbacks(const PtrCallbacks& cbs)
+    {
+        _cbs = cbs;
+    }
+
     void SetConnectedCallback(const ConnectedCallback& cb)
     {
-        _connected_cb = cb;
+        MutableCallbacks()->_connected_cb = cb;
     }
 
     void SetMessageCallback(const MessageCallback&cb)
     {
-        _message_cb = cb;
-        
+        MutableCallbacks()->_message_cb = cb;
     }
 
     void SetClosedCallback(const ClosedCallback&cd)
     {
-        _closed_cb = cd;
+        MutableCallbacks()->_closed_cb = cd;
     }
 
     void SetAnyEventCallback(const AnyEventCallback& cb)
     {
-        _any_event_cb = cb;
-
+        MutableCallbacks()->_any_event_cb = cb;
     }
 
     void SetServerClosedCallback(const ClosedCallback& cb)
     {
-        _server_closed_callback = cb;
+        MutableCallbacks()->_server_closed_cb = cb;
+    }
+
+    //输出缓冲区高低水位：待发送数据涨到high时暂停读取并回调，降到low时恢复读取并回调
+    //high为0表示不限制，需在Established之前设置
+    void SetWaterMarks(size_t high, size_t low)
+    {
+        _high_water_mark = high;
+        _low_water_mark = low < high ? low : high;
+    }
+
+    //边缘触发模式：每次可读/可写事件一直读写到EAGAIN，单次最多budget字节，需在Established之前设置
+    void SetEdgeTriggered(bool on, size_t budget = DEFAULT_IO_BUDGET)
+    {
+        _edge_triggered = on;
+        _io_budget = budget > 0 ? budget : DEFAULT_IO_BUDGET;
+    }
+
+    //零拷贝发送：一次发送的数据不少于threshold字节时使用MSG_ZEROCOPY，0表示关闭，需在Established之前设置
+    //内核直接引用输出缓冲区的数据块，收到完成通知后数据块才归还内存池
+    void EnableZeroCopy(size_t threshold)
+    {
+        if(threshold == 0 || !_sock.SetZeroCopy(true))
+        {
+            _zerocopy_threshold = 0;
+            return ;
+        }
+        _zerocopy_threshold = threshold;
+    }
+
+    //内核忙轮询：接收队列为空时先在驱动上轮询usec微秒
+    bool SetBusyPoll(int usec) { return _sock.SetBusyPoll(usec); }
+
+    void SetHighWaterMarkCallback(const WaterMarkCallback& cb)
+    {
+        MutableCallbacks()->_high_water_cb = cb;
+    }
+
+    void SetLowWaterMarkCallback(const WaterMarkCallback& cb)
+    {
+        MutableCallbacks()->_low_water_cb = cb;
     }
 
 
@@ -117,34 +210,59 @@ public:
 
     void Send(const char* data,size_t len)
     {
-        return  _loop->RunInLoop(std::bind(&Connection::SendInLoop, this, data, len));
+        if(InOwnerLoop())
+        {
+            return SendInLoop(data, len);
+        }
+        //跨线程发送：拷贝一份数据，调用者的缓冲区在返回后即可复用
+        std::string copy(data, len);
+        QueueInOwnerLoop([self = shared_from_this(), copy = std::move(copy)] {
+            self->SendInLoop(copy.data(), copy.size());
+        });
     }
 
+    //发送文件区间[offset, offset+len)，与Send的数据按调用顺序发出
+    //内部复制一份描述符，调用返回后调用者可以关闭自己的fd
+    bool SendFile(int fd, off_t offset, size_t len)
+    {
+        int dupfd = ::fcntl(fd, F_DUPFD_CLOEXEC, 0);
+        if(dupfd < 0)
+        {
+            LOG(ERROR, "SendFile dup error:%d(%s)", errno, strerror(errno));
+            return false;
+        }
+        RunInOwnerLoop([self = shared_from_this(), dupfd, offset, len] {
+            self->SendFileInLoop(dupfd, offset, len);
+        });
+        return true;
+    }
+
+    //投递的任务都持有连接的引用：使用者调用之后立即放手，连接也要等任务执行完才析构
     void Shutdown()
     {
-        return _loop->RunInLoop(std::bind(&Connection::ShutdownInLoop, this));
+        return RunInOwnerLoop([self = shared_from_this()] { self->ShutdownInLoop(); });
     }
 
     void Release()
     {
-        return _loop->RunInLoop(std::bind(&Connection::ReleaseInLoop, this));
+        return RunInOwnerLoop([self = shared_from_this()] { self->ReleaseInLoop(); });
     }
 
     void EnableInactiveRelease(int sec)
     {
-        return _loop->RunInLoop(std::bind(&Connection::EnableInactiveReleaseInLoop,this,sec));
+        return RunInOwnerLoop([self = shared_from_this(), sec] { self->EnableInactiveReleaseInLoop(sec); });
     }
 
     void CancelInactiveRelease()
     {
-        return _loop->RunInLoop(std::bind(&Connection::CancelInactiveReleaseInLoop,this));
+        return RunInOwnerLoop([self = shared_from_this()] { self->CancelInactiveReleaseInLoop(); });
     }
 
     //设置回调
     //就绪
     void Established()
     {
-        return  _loop->RunInLoop(std::bind(&Connection::EstablishedInLoop,this));
+        return RunInOwnerLoop([self = shared_from_this()] { self->EstablishedInLoop(); });
     }
 
     //协议切换
@@ -155,22 +273,85 @@ public:
     const AnyEventCallback& any_event_cb)
     {
         //这个函数必须在线程立即调用，防止新的事件触发的时候，切换任务没有执行
-        _loop->AssertInLoop();
+        Loop()->AssertInLoop();
 
-        _loop->RunInLoop(std::bind(&Connection::UpgradeInLoop,this,context,cb,msg_cb,closed_cb,any_event_cb));
+        RunInOwnerLoop([self = shared_from_this(), context, cb, msg_cb, closed_cb, any_event_cb] {
+            self->UpgradeInLoop(context, cb, msg_cb, closed_cb, any_event_cb);
+        });
+    }
+
+    //迁移到target：在原线程摘下事件监控、空闲定时器和缓冲区，在target线程重新挂上
+    //有数据待发送(含未完成的零拷贝发送)时每隔MIGRATE_RETRY_MS重试，等发完再迁，超过MIGRATE_TIMEOUT_MS放弃
+    //cb(连接, 是否成功)：成功时在target线程、恢复事件监控之前调用，失败时在原线程调用
+    //迁移前会以服务器关闭回调把连接从原线程的连接表中移除，cb中需要登记到新线程并重新设置服务器关闭回调
+    //上下文中保存的与原线程相关的状态由使用者自行处理
+    void MigrateTo(EventLoop* target, const MigrateCallback& cb)
+    {
+        //迁移结束之前先引用target，它不会在途中被下线销毁；失败时放手，成功时原loop放手
+        target->RefConnection();
+        //总是排队执行：在所属线程的事件回调中调用时，等本次事件处理完再摘下
+        QueueInOwnerLoop([self = shared_from_this(), target, cb, deadline = NowNs() / 1000000 + MIGRATE_TIMEOUT_MS] {
+            self->MigrateInLoop(target, cb, deadline);
+        });
     }
 
 private:
+    //引用所挂的loop，连接对象析构之前loop不会被销毁
+    //最先声明、最后析构：缓冲区等成员析构时归还的内存池仍然有效
+    struct LoopRef
+    {
+        EventLoop* _loop;
+        explicit LoopRef(EventLoop* loop) : _loop(loop) { loop->RefConnection(); }
+        ~LoopRef() { _loop->UnrefConnection(); }
+    };
+    LoopRef _loop_ref;
+
     uint64_t _conn_id;
     Socket _sock;
     //是否启用空闲释放
     bool _enable_inactive_release;
 
-    //连接所关联的事件循环
-    EventLoop* _loop;
+    //连接所关联的事件循环，其他线程读取后投递任务；迁移时由原线程改换
+    std::atomic<EventLoop*> _loop;
+    //连接实际挂在哪个loop上，迁移途中为空
+    std::atomic<EventLoop*> _home;
+    //正在读取_loop并投递任务的线程数
+    std::atomic<int> _posting;
+
+    //迁移期间的任务：原线程在改换投递目标后收到的，新线程在连接挂上之前收到的
+    struct MigrateState
+    {
+        std::vector<Task> _stragglers;  //只在原线程访问
+        std::vector<Task> _parked;      //只在新线程访问
+    };
+    std::unique_ptr<MigrateState> _migrate;
+
+    //空闲释放定时器，活动时只记录时间
+    TimerNode _idle_timer;
+
+    //是否已登记本轮迭代结束时的发送
+    bool _flush_pending;
+
+    //输出缓冲区高低水位
+    size_t _high_water_mark;
+    size_t _low_water_mark;
+    bool _above_high_water; //是否处于高水位之上
+    bool _read_paused;      //是否因高水位暂停了读事件监控
+
+    //边缘触发模式及每次事件的读写预算
+    bool _edge_triggered;
+    size_t _io_budget;
 
-    //定时器id
-    uint64_t _timer_id;
+    //零拷贝发送：每次成功的MSG_ZEROCOPY发送由内核依次编号，完成通知按编号区间返回
+    struct ZeroCopySend
+    {
+        uint32_t _id;
+        std::vector<BufferChunk*> _chunks;  //本次发送引用的数据块
+    };
+    size_t _zerocopy_threshold;
+    uint32_t _zerocopy_next_id;
+    std::vector<ZeroCopySend> _zerocopy_pending;
+    PtrConnection _zerocopy_linger;     //释放后等待完成通知期间持有自身，通知收齐后才关闭描述符
     
     //回调函数
     Channel _channel;
@@ -179,103 +360,310 @@ private:
     ConnState _state;
 
     Buffer _in_buffer;
-    Buffer _out_buffer;
+    ChainBuffer _out_buffer;
 
     //请求接收处理上下文
     std::any _context;
 
+    //回调函数，可能与其他连接共用
+    PtrCallbacks _cbs;
 
+    //所有回调为空的共享实例，连接没有设置回调时不单独分配
+    static const PtrCallbacks& EmptyCallbacks()
+    {
+        static const PtrCallbacks empty = std::make_shared<Callbacks>();
+        return empty;
+    }
 
+    EventLoop* Loop() const
+    {
+        return _loop.load(std::memory_order_acquire);
+    }
 
-    ConnectedCallback _connected_cb;
-    MessageCallback _message_cb;
-    ClosedCallback _closed_cb;
-    AnyEventCallback _any_event_cb;
+    //当前线程就是连接挂着的线程
+    bool InOwnerLoop() const
+    {
+        EventLoop* loop = Loop();
+        return loop->IsInLoop() && _home.load(std::memory_order_acquire) == loop;
+    }
 
-    //组件内连接关闭回调
-    ClosedCallback _server_closed_callback;
+    //投递到所属线程执行
+    //从读取_loop到投递完成期间计数，迁移时据此确认不会再有任务投进原loop
+    template<class F>
+    void QueueInOwnerLoop(F&& cb)
+    {
+        _posting.fetch_add(1, std::memory_order_seq_cst);
+        EventLoop* loop = _loop.load(std::memory_order_seq_cst);
+        loop->QueueInLoop([this, loop, cb = std::forward<F>(cb)]() mutable {
+            RunPosted(loop, std::move(cb));
+        });
+        _posting.fetch_sub(1, std::memory_order_release);
+    }
 
-    //处理读事件
-    void HandleRead()
+    template<class F>
+    void RunInOwnerLoop(F&& cb)
     {
-        char buff[65536];
-        ssize_t ret = _sock.NonBlockRecv(buff, sizeof(buff) -1);
-        if(ret == 0)
+        if(InOwnerLoop())
         {
-            return ShutdownInLoop();
+            return cb();
         }
+        QueueInOwnerLoop(std::forward<F>(cb));
+    }
 
-        if(ret < 0)
+    //投递的任务到了loop：连接可能正在迁出、正在迁入，或者早已迁走
+    template<class F>
+    void RunPosted(EventLoop* loop, F&& cb)
+    {
+        bool home = _home.load(std::memory_order_acquire) == loop;
+        bool owner = _loop.load(std::memory_order_acquire) == loop;
+        if(home && owner)
         {
-            if(ret == -2)
-            {
-                return; // 可重试，等待下次读事件
-            }
-            return ShutdownInLoop();
+            return cb();
         }
+        if(home)
+        {
+            //正在迁出：带到新线程，排在新线程直接收到的任务之前
+            _migrate->_stragglers.emplace_back(std::move(cb));
+            return ;
+        }
+        if(owner)
+        {
+            //正在迁入：连接挂上之后再执行
+            _migrate->_parked.emplace_back(std::move(cb));
+            return ;
+        }
+        QueueInOwnerLoop(std::move(cb));
+    }
 
-        _in_buffer.Write(buff,ret);
+    //修改回调前确保独占一份
+    Callbacks* MutableCallbacks()
+    {
+        if(_cbs.use_count() > 1)
+        {
+            _cbs = std::make_shared<Callbacks>(*_cbs);
+        }
+        return _cbs.get();
+    }
 
-        //调用回调
+    //有数据时交给消息回调；处理完缓冲区为空就归还存储，空闲连接不占用输入缓冲区
+    void DispatchMessage()
+    {
         if(_in_buffer.ReadAbleSize() > 0)
         {
             auto self = shared_from_this();
-            return _message_cb(self, &_in_buffer);
+            _cbs->_message_cb(self, &_in_buffer);
+        }
+        if(_in_buffer.ReadAbleSize() == 0)
+        {
+            _in_buffer.Release();
+        }
+    }
+
+    //处理读事件
+    //水平触发每次事件读一次；边缘触发一直读到EAGAIN，超出预算时排到任务队列稍后继续
+    void HandleRead() override
+    {
+        size_t total = 0;
+        do
+        {
+            //直接读入输入缓冲区，放不下的部分经由循环共享的溢出区追加
+            ssize_t ret = _in_buffer.ReadFd(_sock.fd(), Loop()->ExtraBuffer(), Loop()->ExtraBufferSize());
+            if(ret == 0)
+            {
+                return ShutdownInLoop();
+            }
+
+            if(ret < 0)
+            {
+                if(ret == -2)
+                {
+                    return; // 可重试，等待下次读事件
+                }
+                return ShutdownInLoop();
+            }
+            total += ret;
+
+            //调用回调
+            DispatchMessage();
+        } while(_edge_triggered && _state == CONNECTED && !_read_paused && total < _io_budget);
+
+        //边缘触发下不会再收到这批数据的通知，预算用完时让其他连接先处理，再回来接着读
+        if(_edge_triggered && _state == CONNECTED && !_read_paused && total >= _io_budget)
+        {
+            QueueInOwnerLoop([self = shared_from_this()] {
+                if(self->_state == CONNECTED && !self->_read_paused) self->HandleRead();
+            });
         }
     }
 
     //处理写事件
-    void HandleWrite()
+    //内存数据块用writev，文件段用sendfile，依次发送直到发完或者套接字发送缓冲区满
+    void HandleWrite() override
     {
-        //_out_buffer中保存的数据就是要发送的数据
-        ssize_t ret = _sock.NonBlockSend(_out_buffer.ReadPosition(), _out_buffer.ReadAbleSize());
-        if(ret < 0)
+        size_t total = 0;
+        while(_out_buffer.ReadAbleSize() > 0)
         {
-            if(ret == -2)
+            if(total >= _io_budget)
+            {
+                //预算用完：水平触发会再次通知；边缘触发需要自己排队继续
+                if(_edge_triggered && _channel.WriteAble())
+                {
+                    QueueInOwnerLoop([self = shared_from_this()] {
+                        if(self->_state != DISCONECTED && self->_channel.WriteAble()) self->HandleWrite();
+                    });
+                }
+                return;
+            }
+            ssize_t ret;
+            uint64_t expect;
+            if(_out_buffer.FrontIsFile())
             {
-                return; // 写缓冲区满，等待下一次写事件
+                ChainSegment& seg = _out_buffer.FrontFile();
+                expect = seg._len;
+                off_t offset = seg._offset;
+                ret = _sock.SendFile(seg._fd, &offset, expect);
+                if(ret == 0)
+                {
+                    //文件被截断，剩余部分已经无法发送
+                    LOG(ERROR, "SendFile: file truncated, conn %lu", _conn_id);
+                    ret = -1;
+                }
             }
-            if(_in_buffer.ReadAbleSize() > 0)
+            else
             {
-                auto self = shared_from_this();
-                _message_cb(self, &_in_buffer);
+                //_out_buffer中保存的数据就是要发送的数据，连续的数据块一次writev发出
+                struct iovec iov[IOV_MAX];
+                BufferChunk* chunks[IOV_MAX];
+                int iovcnt = _out_buffer.FillIovec(iov, IOV_MAX, chunks);
+                expect = 0;
+                for(int i = 0; i < iovcnt; i++) expect += iov[i].iov_len;
+                ret = -3;
+                if(_zerocopy_threshold > 0 && expect >= _zerocopy_threshold)
+                {
+                    ret = _sock.SendvZeroCopy(iov, iovcnt);
+                    if(ret > 0) PinZeroCopySend(iov, chunks, iovcnt, ret);
+                }
+                if(ret == -3)
+                {
+                    ret = _sock.NonBlockSendv(iov, iovcnt);
+                }
+            }
+            if(ret < 0)
+            {
+                if(ret == -2)
+                {
+                    return; // 写缓冲区满，等待下一次写事件
+                }
+                DispatchMessage();
+                return Release();//这时候就是实际的关闭释放操作了。
+            }
+
+            _out_buffer.MoveReadOffset(ret);//千万不要忘了，将读偏移向后移动
+            total += ret;
+            CheckLowWater();
+            if(static_cast<uint64_t>(ret) < expect)
+            {
+                return; // 只发出一部分，套接字发送缓冲区已满
             }
-            return Release();//这时候就是实际的关闭释放操作了。
         }
 
-        _out_buffer.MoveReadOffset(ret);//千万不要忘了，将读偏移向后移动
-        if (_out_buffer.ReadAbleSize() == 0) {
-            _channel.DisableWrite();// 没有数据待发送了，关闭写事件监控
-            //如果当前是连接待关闭状态，则有数据，发送完数据释放连接，没有数据则直接释放
-            if (_state == DISCONNECTING) {
-                return Release();
+        if (_channel.WriteAble()) _channel.DisableWrite();// 没有数据待发送了，关闭写事件监控
+        //如果当前是连接待关闭状态，则有数据，发送完数据释放连接，没有数据则直接释放
+        if (_state == DISCONNECTING) {
+            return Release();
+        }
+    }
+
+    //记录一次零拷贝发送引用的数据块，在完成通知到来前不能复用
+    void PinZeroCopySend(const struct iovec* iov, BufferChunk** chunks, int iovcnt, size_t sent)
+    {
+        ZeroCopySend zc;
+        zc._id = _zerocopy_next_id++;
+        for(int i = 0; i < iovcnt && sent > 0; i++)
+        {
+            _out_buffer.Pin(chunks[i]);
+            zc._chunks.push_back(chunks[i]);
+            sent -= std::min(sent, iov[i].iov_len);
+        }
+        _zerocopy_pending.push_back(std::move(zc));
+    }
+
+    //错误队列可读：处理零拷贝完成通知，解除对应数据块的引用
+    //返回true表示套接字本身没有错误
+    bool HandleErrQueue() override
+    {
+        if(_zerocopy_threshold == 0) return false;
+        ReapZeroCopyCompletions();
+        if(_zerocopy_linger && _zerocopy_pending.empty())
+        {
+            FinishZeroCopyLinger();
+            return true;
+        }
+        return _sock.PendingError() == 0;
+    }
+
+    //读取已到达的完成通知，解除对应数据块的引用
+    void ReapZeroCopyCompletions()
+    {
+        std::vector<std::pair<uint32_t, uint32_t>> ranges;
+        _sock.ReadZeroCopyCompletions(&ranges);
+        for(auto& range : ranges)
+        {
+            for(auto it = _zerocopy_pending.begin(); it != _zerocopy_pending.end();)
+            {
+                //序号是32位回绕计数，按差值判断是否落在[lo, hi]内
+                if(it->_id - range.first <= range.second - range.first)
+                {
+                    for(auto chunk : it->_chunks) _out_buffer.Unpin(chunk);
+                    it = _zerocopy_pending.erase(it);
+                }
+                else
+                {
+                    ++it;
+                }
             }
         }
-        return;
     }
 
-    //处理关闭事件
-    void HandleClose()
+    //真正关闭描述符；被迫结束等待时(对端已断开)先收取已到达的完成通知
+    //仍未完成的数据块内核可能还在引用(重传)，不再归还内存池，以免被之后的发送复用后内容被改写
+    void FinishZeroCopyLinger()
     {
-        if(_in_buffer.ReadAbleSize() > 0)
+        if(!_zerocopy_pending.empty())
         {
-            auto self = shared_from_this();
-            _message_cb(self, &_in_buffer);
+            ReapZeroCopyCompletions();
         }
+        if(!_zerocopy_pending.empty())
+        {
+            size_t leaked = 0;
+            for(auto& zc : _zerocopy_pending) leaked += zc._chunks.size();
+            LOG(DEBUG,"connection %d closed with %zu zerocopy chunks in flight, not recycled",(int)_conn_id,leaked);
+        }
+        _zerocopy_pending.clear();
+        _channel.Remove();
+        _sock.Close();
+        PtrConnection self;
+        self.swap(_zerocopy_linger);//事件处理期间Channel持有引用，这里放手不会立即析构
+    }
+
+    //处理关闭事件
+    void HandleClose() override
+    {
+        DispatchMessage();
 
         return Release();
 
     }
 
     //处理错误事件
-    void HandleError()
+    void HandleError() override
     {
         return HandleClose();
     }                                                                                                  
 
 
     //处理任意事件
-    void HandleEvent()
+    void HandleEvent() override
     {
         if(_state != CONNECTED)
         {
@@ -284,13 +672,13 @@ private:
 
         if(_enable_inactive_release == true)
         {
-            _loop->TimerRefresh(_conn_id);
+            Loop()->IdleTimerTouch(&_idle_timer);
         }
 
-        if(_any_event_cb)
+        if(_cbs->_any_event_cb)
         {
             auto self = shared_from_this();
-            _any_event_cb(self);
+            _cbs->_any_event_cb(self);
         }
     }
 
@@ -305,7 +693,84 @@ private:
         }
 
         _out_buffer.Write(data,len);
-        if(_out_buffer.ReadAbleSize() > 0)
+        CheckHighWater();
+        ScheduleFlush();
+    }
+
+    void SendFileInLoop(int fd, off_t offset, size_t len)
+    {
+        if(_state != CONNECTED)
+        {
+            ::close(fd);
+            return ;
+        }
+
+        _out_buffer.WriteFile(fd, offset, len);
+        CheckHighWater();
+        ScheduleFlush();
+    }
+
+    //待发送数据越过高水位：暂停读取，对端的请求留在内核缓冲区，由TCP流控反压对端
+    void CheckHighWater()
+    {
+        if(_high_water_mark == 0 || _above_high_water || _out_buffer.ReadAbleSize() < _high_water_mark)
+        {
+            return ;
+        }
+        _above_high_water = true;
+        if(_channel.ReadAble())
+        {
+            _channel.DisableRead();
+            _read_paused = true;
+        }
+        if(_cbs->_high_water_cb)
+        {
+            auto self = shared_from_this();
+            _cbs->_high_water_cb(self, _out_buffer.ReadAbleSize());
+        }
+    }
+
+    //待发送数据回落到低水位：恢复读取
+    void CheckLowWater()
+    {
+        if(!_above_high_water || _out_buffer.ReadAbleSize() > _low_water_mark)
+        {
+            return ;
+        }
+        _above_high_water = false;
+        if(_read_paused && _state == CONNECTED)
+        {
+            _channel.EnableRead();
+        }
+        _read_paused = false;
+        if(_cbs->_low_water_cb)
+        {
+            auto self = shared_from_this();
+            _cbs->_low_water_cb(self, _out_buffer.ReadAbleSize());
+        }
+    }
+
+    //已在等待可写事件时由HandleWrite发送；否则登记到本轮迭代结束时直接发送，
+    //同一轮中的多次Send合并为一次writev，小响应不再需要开启写事件监控
+    void ScheduleFlush()
+    {
+        if(!_channel.WriteAble() && !_flush_pending && _out_buffer.ReadAbleSize() > 0)
+        {
+            _flush_pending = true;
+            Loop()->QueueFlush([self = shared_from_this()] { self->FlushInLoop(); });
+        }
+    }
+
+    //直接发送输出缓冲区，发送不完再开启写事件监控
+    void FlushInLoop()
+    {
+        _flush_pending = false;
+        if(_state == DISCONECTED || _channel.WriteAble() || _out_buffer.ReadAbleSize() == 0)
+        {
+            return ;
+        }
+        HandleWrite();
+        if(_state != DISCONECTED && _out_buffer.ReadAbleSize() > 0)
         {
             _channel.EnableWrite();
         }
@@ -315,13 +780,10 @@ private:
     void ShutdownInLoop()
     {
         _state = DISCONNECTING;
-        if(_in_buffer.ReadAbleSize() > 0)
-        {
-            auto self = shared_from_this();
-            _message_cb(self, &_in_buffer);
-        }
+        DispatchMessage();
 
-        if(_out_buffer.ReadAbleSize() > 0)
+        //已登记直接发送时由FlushInLoop处理，发送完毕后释放
+        if(_out_buffer.ReadAbleSize() > 0 && !_flush_pending && !_channel.WriteAble())
         {
             _channel.EnableWrite();
         }
@@ -336,25 +798,20 @@ private:
     void EnableInactiveReleaseInLoop(int sec)
     {
         _enable_inactive_release = true;
-
-        if(_loop -> HasTimer(_conn_id))
-        {
-            _loop->TimerRefresh(_conn_id);
-        }
-
-
-        _loop->TimerAdd(_conn_id,sec,std::bind(&Connection::Release,this));
+        if(sec <= 0) sec = 1;
+        _idle_timer._task_cb = [this] {
+            //服务器可能在释放过程中移除最后一个引用
+            PtrConnection self = shared_from_this();
+            ReleaseInLoop();
+        };
+        Loop()->IdleTimerStart(&_idle_timer, (uint64_t)sec * 1000);
     }
 
     //取消空闲释放
     void CancelInactiveReleaseInLoop()
     {
         _enable_inactive_release = false;
-
-        if(_loop->HasTimer(_conn_id))
-        {
-            _loop->TimerCancel(_conn_id);
-        }
+        Loop()->IdleTimerStop(&_idle_timer);
     }
 
     //实际释放
@@ -368,25 +825,43 @@ private:
     */
     void ReleaseInLoop()
     {
+        if(_state == DISCONECTED)
+        {
+            //已经释放过：只可能是在等待零拷贝完成通知时对端断开，不再等待
+            if(_zerocopy_linger) FinishZeroCopyLinger();
+            return ;
+        }
         _state = DISCONECTED;
-        _channel.Remove();
-        _sock.Close();
-        if(_loop->HasTimer(_conn_id))
+        //服务器关闭回调会移除连接表中的引用，保证本函数返回前连接仍然存活
+        PtrConnection self = shared_from_this();
+        if(_zerocopy_pending.empty())
         {
-            _loop->TimerCancel(_conn_id);
+            _channel.Remove();
+            _sock.Close();
         }
+        else
+        {
+            //内核还在引用零拷贝发出的数据块，描述符关闭后就收不到完成通知了
+            //先半关闭并停止监控读写，错误队列通知仍会以EPOLLERR报告，收齐后再关闭
+            ::shutdown(_sock.fd(), SHUT_WR);
+            _channel.DisableAll();
+            _zerocopy_linger = self;
+        }
+        Loop()->IdleTimerStop(&_idle_timer);
 
-        if(_closed_cb)
+        if(_cbs->_closed_cb)
         {
-            auto self = shared_from_this();
-            _closed_cb(self);
+            _cbs->_closed_cb(self);
         }
 
-        if(_server_closed_callback)
+        if(_cbs->_server_closed_cb)
         {
-            auto self = shared_from_this();
-            _server_closed_callback(self);
+            _cbs->_server_closed_cb(self);
         }
+
+        //缓冲区存储在本线程归还内存池
+        _in_buffer.Release();
+        _out_buffer.Clear();
     }
 
     //连接获取后，所处状态下要进行各种设置(启动读监控，调用回调函数)
@@ -395,14 +870,128 @@ private:
         assert(_state == CONNECTING);
 
         _state = CONNECTED;
+        //事件处理期间保证连接对象存活，防止回调中连接被其他线程释放
+        _channel.Tie(shared_from_this());
+        if(_edge_triggered)
+        {
+            _channel.SetEdgeTriggered(true);
+        }
         _channel.EnableRead();
-        if(_connected_cb)
+        if(_cbs->_connected_cb)
         {
             auto self = shared_from_this();
-            _connected_cb(self);
+            _cbs->_connected_cb(self);
+        }
+    }
+
+
+    //迁移第一步，在原线程执行：等连接空闲后停止它在原线程的一切活动，改换投递目标
+    void MigrateInLoop(EventLoop* target, const MigrateCallback& cb, uint64_t deadline)
+    {
+        PtrConnection self = shared_from_this();
+        //重试期间被另一次迁移带走了
+        if(!InOwnerLoop())
+        {
+            return QueueInOwnerLoop([self, target, cb, deadline] { self->MigrateInLoop(target, cb, deadline); });
+        }
+        EventLoop* from = Loop();
+        if(target == from)
+        {
+            if(cb) cb(self, _state == CONNECTED);
+            target->UnrefConnection();
+            return ;
+        }
+        if(_state != CONNECTED)
+        {
+            if(cb) cb(self, false);
+            target->UnrefConnection();
+            return ;
+        }
+        //输出缓冲区和零拷贝引用的数据块属于原线程的内存池，发完之前不能迁移
+        if(_out_buffer.ReadAbleSize() > 0 || _flush_pending || !_zerocopy_pending.empty())
+        {
+            if(NowNs() / 1000000 >= deadline)
+            {
+                if(cb) cb(self, false);
+                target->UnrefConnection();
+                return ;
+            }
+            from->RunAfter(MIGRATE_RETRY_MS, [self, target, cb, deadline] {
+                self->MigrateInLoop(target, cb, deadline);
+            });
+            return ;
         }
+
+        _channel.Remove();
+        if(_enable_inactive_release)
+        {
+            from->IdleTimerStop(&_idle_timer);
+        }
+        _migrate = std::make_unique<MigrateState>();
+        _loop.store(target, std::memory_order_seq_cst);
+        HandOverInLoop(from, target, cb);
     }
 
+    //迁移第二步，在原线程执行：已经读到原loop的投递者都投递完之后，原线程的迟到任务就都排在这之前了
+    void HandOverInLoop(EventLoop* from, EventLoop* target, const MigrateCallback& cb)
+    {
+        PtrConnection self = shared_from_this();
+        if(_posting.load(std::memory_order_seq_cst) > 0)
+        {
+            //投递者正处在读取和投递之间，只有几条指令，下一轮再看
+            from->QueueInLoop([self, from, target, cb] { self->HandOverInLoop(from, target, cb); });
+            return ;
+        }
+        from->QueueInLoop([self, target, cb] { self->DetachInLoop(target, cb); });
+    }
+
+    //迁移第三步，在原线程执行：从原线程摘下，交给新线程
+    void DetachInLoop(EventLoop* target, const MigrateCallback& cb)
+    {
+        PtrConnection self = shared_from_this();
+        //从原线程的服务器连接表中移除
+        if(_cbs->_server_closed_cb)
+        {
+            _cbs->_server_closed_cb(self);
+        }
+        //输入缓冲区中还没处理完的数据带过去，存储归还原线程的内存池
+        std::string pending(_in_buffer.ReadPosition(), _in_buffer.ReadAbleSize());
+        _in_buffer.Release();
+        _out_buffer.Clear();
+        _in_buffer.SetPool(target->GetBufferPool());
+        _out_buffer.SetPool(target->GetBufferPool());
+        _channel.SetLoop(target);
+        _home.store(nullptr, std::memory_order_release);
+        target->QueueInLoop([self, pending = std::move(pending), cb] {
+            self->AttachInLoop(pending, cb);
+        });
+        //原loop不再有这个连接的任务，放手
+        EventLoop* from = _loop_ref._loop;
+        _loop_ref._loop = target;
+        from->UnrefConnection();
+    }
+
+    //迁移第四步，在新线程执行：重新挂上，再按顺序执行迁移期间收到的任务
+    void AttachInLoop(const std::string& pending, const MigrateCallback& cb)
+    {
+        EventLoop* loop = _channel.OwnerLoop();
+        PtrConnection self = shared_from_this();
+        if(!pending.empty())
+        {
+            _in_buffer.Write(pending.data(), pending.size());
+        }
+        if(cb) cb(self, true);
+        if(_enable_inactive_release)
+        {
+            loop->IdleTimerStart(&_idle_timer, _idle_timer._delay);
+        }
+        //按迁移前的事件重新注册
+        _channel.Update();
+        std::unique_ptr<MigrateState> state = std::move(_migrate);
+        _home.store(loop, std::memory_order_release);
+        for(auto& task : state->_stragglers) task();
+        for(auto& task : state->_parked) task();
+    }
 
     void UpgradeInLoop(const std::any& context,const ConnectedCallback& cb,
     const MessageCallback& msg_cb,
@@ -410,9 +999,10 @@ private:
     const AnyEventCallback& any_event_cb)
     {
         _context = context;
-        _connected_cb = cb;
-        _message_cb = msg_cb;
-        _closed_cb = closed_cb;
-        _any_event_cb = any_event_cb;
+        Callbacks* cbs = MutableCallbacks();
+        cbs->_connected_cb = cb;
+        cbs->_message_cb = msg_cb;
+        cbs->_closed_cb = closed_cb;
+        cbs->_any_event_cb = any_event_cb;
     }
 };
\ No newline at end of file
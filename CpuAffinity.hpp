@@ -0,0 +1,217 @@
+#pragma once
+#include "Log.hpp"
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+using namespace log_ns;
+
+//子loop在CPU上的分布方式
+enum class CpuPlacement {
+    NONE,       //不绑核，由调度器决定
+    COMPACT,    //先占满一个NUMA节点再用下一个：loop之间共享末级缓存，适合网卡中断集中在一个节点
+    SCATTER,    //轮流落在各个节点上：各节点的内存带宽都用上
+};
+
+//CPU拓扑：本进程可用的CPU按NUMA节点分组，读自/sys；读不到时当作一个节点
+class CpuTopology {
+public:
+    struct Node
+    {
+        int _id;
+        std::vector<int> _cpus;
+    };
+
+    static CpuTopology Detect()
+    {
+        CpuTopology topo;
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        if(::sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+        {
+            for(int i = 0; i < CPU_SETSIZE; i++) CPU_SET(i, &allowed);
+        }
+        //容器中cgroup限制的CPU也体现在亲和性里，只保留可用的
+        auto usable = [&allowed](std::vector<int> cpus) {
+            cpus.erase(std::remove_if(cpus.begin(), cpus.end(), [&allowed](int cpu) {
+                return cpu < 0 || cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &allowed);
+            }), cpus.end());
+            return cpus;
+        };
+
+        DIR* dir = ::opendir("/sys/devices/system/node");
+        if(dir != nullptr)
+        {
+            struct dirent* ent;
+            while((ent = ::readdir(dir)) != nullptr)
+            {
+                if(strncmp(ent->d_name, "node", 4) != 0 || !isdigit((unsigned char)ent->d_name[4])) continue;
+                Node node;
+                node._id = atoi(ent->d_name + 4);
+                node._cpus = usable(ParseList(ReadLine(std::string("/sys/devices/system/node/") + ent->d_name + "/cpulist")));
+                if(!node._cpus.empty()) topo._nodes.push_back(std::move(node));
+            }
+            ::closedir(dir);
+        }
+        if(topo._nodes.empty())
+        {
+            Node node;
+            node._id = 0;
+            for(int i = 0; i < CPU_SETSIZE; i++)
+            {
+                if(CPU_ISSET(i, &allowed)) node._cpus.push_back(i);
+            }
+            topo._nodes.push_back(std::move(node));
+        }
+        std::sort(topo._nodes.begin(), topo._nodes.end(), [](const Node& a, const Node& b) { return a._id < b._id; });
+
+        for(auto& node : topo._nodes)
+        {
+            for(int cpu : node._cpus)
+            {
+                if(cpu >= (int)topo._node_of.size())
+                {
+                    topo._node_of.resize(cpu + 1, -1);
+                    topo._siblings.resize(cpu + 1);
+                }
+                topo._node_of[cpu] = node._id;
+                std::vector<int> sib = usable(ParseList(ReadLine(
+                    "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/thread_siblings_list")));
+                sib.erase(std::remove(sib.begin(), sib.end(), cpu), sib.end());
+                topo._siblings[cpu] = std::move(sib);
+            }
+        }
+        return topo;
+    }
+
+    const std::vector<Node>& Nodes() const { return _nodes; }
+
+    //cpu所在的节点，不可用的CPU返回-1
+    int NodeOf(int cpu) const
+    {
+        return cpu >= 0 && cpu < (int)_node_of.size() ? _node_of[cpu] : -1;
+    }
+
+    //同一物理核上其他可用的超线程
+    const std::vector<int>& Siblings(int cpu) const
+    {
+        static const std::vector<int> none;
+        return cpu >= 0 && cpu < (int)_siblings.size() ? _siblings[cpu] : none;
+    }
+
+    //按放置方式给出使用CPU的顺序
+    //每个节点内先排各物理核的第一个超线程，核用完了才用到同一个核上的其他超线程
+    std::vector<int> Order(CpuPlacement placement) const
+    {
+        std::vector<int> order;
+        if(placement == CpuPlacement::NONE) return order;
+        std::vector<std::vector<int>> per_node;
+        for(auto& node : _nodes)
+        {
+            std::vector<int> first, rest;
+            for(int cpu : node._cpus)
+            {
+                const std::vector<int>& sib = Siblings(cpu);
+                bool primary = std::all_of(sib.begin(), sib.end(), [cpu](int s) { return s > cpu; });
+                (primary ? first : rest).push_back(cpu);
+            }
+            first.insert(first.end(), rest.begin(), rest.end());
+            per_node.push_back(std::move(first));
+        }
+        if(placement == CpuPlacement::COMPACT)
+        {
+            for(auto& cpus : per_node) order.insert(order.end(), cpus.begin(), cpus.end());
+            return order;
+        }
+        for(size_t i = 0; ; i++)
+        {
+            bool any = false;
+            for(auto& cpus : per_node)
+            {
+                if(i < cpus.size())
+                {
+                    order.push_back(cpus[i]);
+                    any = true;
+                }
+            }
+            if(!any) break;
+        }
+        return order;
+    }
+
+private:
+    static std::string ReadLine(const std::string& path)
+    {
+        std::ifstream in(path);
+        std::string line;
+        std::getline(in, line);
+        return line;
+    }
+
+    //解析"0-3,8,10-11"形式的CPU列表
+    static std::vector<int> ParseList(const std::string& s)
+    {
+        std::vector<int> cpus;
+        size_t pos = 0;
+        while(pos < s.size())
+        {
+            size_t end = s.find(',', pos);
+            if(end == std::string::npos) end = s.size();
+            std::string item = s.substr(pos, end - pos);
+            size_t dash = item.find('-');
+            if(!item.empty() && isdigit((unsigned char)item[0]))
+            {
+                int lo = atoi(item.c_str());
+                int hi = dash == std::string::npos ? lo : atoi(item.c_str() + dash + 1);
+                for(int cpu = lo; cpu <= hi; cpu++) cpus.push_back(cpu);
+            }
+            pos = end + 1;
+        }
+        return cpus;
+    }
+
+    std::vector<Node> _nodes;
+    std::vector<int> _node_of;              //按CPU编号索引
+    std::vector<std::vector<int>> _siblings;//按CPU编号索引
+};
+
+//把当前线程绑到cpu上
+inline bool PinCurrentThread(int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int ret = ::pthread_setaffinity_np(::pthread_self(), sizeof(set), &set);
+    if(ret != 0)
+    {
+        LOG(WARNING, "pin thread to cpu %d error:%d(%s)", cpu, ret, strerror(ret));
+        return false;
+    }
+    return true;
+}
+
+//当前线程之后申请的内存优先来自node
+//默认的首次访问分配已经是本地节点，这里保证进程以交错等策略启动时loop线程仍然用本地内存
+inline bool PreferLocalMemory(int node)
+{
+    const int MAX_NODES = 1024;
+    unsigned long mask[MAX_NODES / (8 * sizeof(unsigned long))] = {0};
+    if(node < 0 || node >= MAX_NODES) return false;
+    mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+    //内核按maxnode-1位读取掩码
+    if(::syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, (unsigned long)MAX_NODES + 1) < 0)
+    {
+        LOG(WARNING, "set_mempolicy node %d error:%d(%s)", node, errno, strerror(errno));
+        return false;
+    }
+    return true;
+}
@@ -2,43 +2,152 @@
 #include "Channel.hpp"
 #include "Poller.hpp"
 #include"TimeWheel.hpp"
+#include"BufferPool.hpp"
+#include"TaskQueue.hpp"
+#include"Task.hpp"
 #include<thread>
 #include<memory>
 #include<atomic>
+#include<any>
 #include<sys/eventfd.h>
 #include<cassert>
 
+const uint64_t LOOP_EXTRA_BUFFER_SIZE = 65536;
+const uint64_t LOOP_LOAD_WINDOW_NS = 100 * 1000000;    //负载统计窗口
+const uint64_t LOOP_BUSY_POLL_MIN_NS = 1000;            //空转预算减到这以下就不再空转
+
 //事件监控管理模块
 //事件监控 就绪事件处理 执行任务
 class EventLoop
 {
 private:
-    using Functor = std::function<void()>;
+    using Functor = Task;
     int _event_fd;
 
     std::unique_ptr<Channel> _eventChannel;//通知事件描述符
     std::thread::id _threadId;
 
     Poller _poller;//事件監控
-    std::vector<Functor> _task;//任務隊列
-    std::mutex _mutex;
+    std::vector<Channel*> _activeChannels;//本轮就绪的channel，每轮复用
+    size_t _activeIndex;//正在处理的下标
+    std::vector<Channel*> _dirtyChannels;//本轮兴趣有变更的channel，Poll之前统一提交
+    MpscQueue<Functor> _task;//任務隊列，其他线程无锁投递
+    std::atomic<bool> _wakeup_pending;//已经写过eventfd、还没有开始执行任务
+
+    std::vector<Functor> _pendingFlush;//本轮迭代结束时执行的发送任务，只在本线程访问
+    std::vector<Functor> _flushing;
 
     TimerWheel _timerWheel;//定時器
+    std::atomic<uint64_t> _timerSeq;//RunAfter/RunEvery自动分配的定时器编号
+    uint64_t _pollTime;//本轮Poll返回的时间(毫秒)，本轮内的活动时间都用它，不再逐次读时钟
+
+    //负载统计：Poll之外的时间即忙碌时间，每个窗口结束时发布千分比，供其他线程选择loop
+    uint64_t _iterStartNs;//本轮Poll返回的时间(纳秒)
+    uint64_t _busyNs;//本窗口累计的忙碌时间
+    uint64_t _windowStartNs;
+    std::atomic<uint32_t> _load;//上一个窗口的忙碌千分比
+    std::atomic<uint64_t> _pollSinceNs;//开始阻塞在Poll中的时间，0表示不在Poll中
+    std::atomic<int> _connCount;//分配给本循环、尚未移除的连接数
+    std::atomic<int> _connRefs;//引用本循环的Connection对象数
+    int _cpu;               //绑定的CPU，-1表示没有绑定
+    int _numaNode;          //绑定的CPU所在NUMA节点
+    std::any _context;      //使用者附加在本循环上的数据，只在本循环线程访问
+    uint64_t _spinMaxNs;    //忙轮询的空转上限，0表示关闭
+    uint64_t _spinNs;       //当前的空转预算，随空闲程度伸缩
     std::atomic<bool> _quit;
 
+    std::vector<char> _extraBuf;//读事件的溢出区，本循环内所有连接共用
+    BufferPool _bufferPool;//连接缓冲区内存池，本循环内所有连接共用
+
 
     void RunAllTask()
     {
-        std::vector<Functor> tmp;
+        //先清除标志再取任务：之后投递的任务会重新唤醒，不会漏掉
+        _wakeup_pending.store(false);
+        _task.ConsumeAll([](Functor& cb) { cb(); });
+    }
 
+    //提交本轮积累的兴趣变更
+    void ApplyDirtyEvents()
+    {
+        for(Channel* channel : _dirtyChannels)
         {
-            std::lock_guard<std::mutex> lock(_mutex);
-            tmp.swap(_task);
+            if(channel == nullptr) continue;
+            channel->ClearDirty();
+            if(channel->NeedSync())
+            {
+                _poller.UpdateEvent(channel);
+                channel->Synced();
+            }
         }
+        _dirtyChannels.clear();
+    }
 
-        for (auto& cb : tmp)
+    //进入Poll之前：累计本轮忙碌时间，窗口结束时发布负载
+    void LoadBeforePoll()
+    {
+        uint64_t now = NowNs();
+        _busyNs += now - _iterStartNs;
+        if(now - _windowStartNs >= LOOP_LOAD_WINDOW_NS)
         {
-            cb();
+            _load.store((uint32_t)(_busyNs * 1000 / (now - _windowStartNs)), std::memory_order_relaxed);
+            _busyNs = 0;
+            _windowStartNs = now;
+        }
+        _pollSinceNs.store(now, std::memory_order_relaxed);
+    }
+
+    void LoadAfterPoll()
+    {
+        uint64_t now = NowNs();
+        _pollSinceNs.store(0, std::memory_order_relaxed);
+        _iterStartNs = now;
+        _pollTime = now / 1000000;
+    }
+
+    //忙轮询：阻塞之前先用零超时Poll空转，事件在预算内到达就省掉一次睡眠和唤醒
+    //空转落空预算减半，持续空闲时很快退回纯阻塞；阻塞后很快等到事件，说明空转本可以接住，预算恢复到上限
+    //空转时间算在Poll之内，负载统计仍把它当作空闲
+    void BusyPoll(int timeout)
+    {
+        if(_spinNs > 0)
+        {
+            uint64_t spin_start = NowNs();
+            uint64_t budget = _spinNs;
+            if(timeout > 0 && (uint64_t)timeout * 1000000 < budget) budget = (uint64_t)timeout * 1000000;
+            do
+            {
+                _poller.Poll(&_activeChannels, 0);
+                if(!_activeChannels.empty())
+                {
+                    _spinNs = _spinMaxNs;
+                    return ;
+                }
+            } while(NowNs() - spin_start < budget);
+            _spinNs /= 2;
+            if(_spinNs < LOOP_BUSY_POLL_MIN_NS) _spinNs = 0;
+            if(timeout > 0) timeout = _timerWheel.PollTimeout();
+        }
+        uint64_t start = NowNs();
+        _poller.Poll(&_activeChannels, timeout);
+        if(!_activeChannels.empty() && NowNs() - start < _spinMaxNs)
+        {
+            _spinNs = _spinMaxNs;
+        }
+    }
+
+    //执行本轮迭代中积攒的发送任务，同一连接多次Send合并成一次系统调用
+    //发送中的回调(关闭、水位)可能又在其他连接上Send，一直执行到没有新的发送任务，不留到下一次Poll之后
+    void RunPendingFlush()
+    {
+        while(!_pendingFlush.empty())
+        {
+            _flushing.swap(_pendingFlush);
+            for (auto& cb : _flushing)
+            {
+                cb();
+            }
+            _flushing.clear();
         }
     }
     static int CreateEventFd()
@@ -57,13 +166,29 @@ public:
     _event_fd(CreateEventFd()),
     _eventChannel(std::make_unique<Channel>(_event_fd,this)),
     _threadId(std::this_thread::get_id()),
-    _timerWheel(this)
+    _activeIndex(0),
+    _timerWheel(this),
+    _timerSeq(0),
+    _pollTime(NowMs()),
+    _iterStartNs(NowNs()),
+    _busyNs(0),
+    _windowStartNs(_iterStartNs),
+    _load(0),
+    _pollSinceNs(0),
+    _connCount(0),
+    _connRefs(0),
+    _cpu(-1),
+    _numaNode(-1),
+    _spinMaxNs(0),
+    _spinNs(0),
+    _extraBuf(LOOP_EXTRA_BUFFER_SIZE)
     {
         //设置事件回调
         _eventChannel->SetReadCallback(std::bind(&EventLoop::ReadEventfd,this));//每隔
         //设置事件类型
         _eventChannel->EnableRead();
         _quit.store(false, std::memory_order_relaxed);
+        _wakeup_pending.store(false, std::memory_order_relaxed);
     }
 
 
@@ -109,21 +234,35 @@ public:
         _quit.store(false, std::memory_order_relaxed);
         while(!_quit.load(std::memory_order_relaxed))
         {
-            std::vector<Channel*> activeChannels;
-            //监听活跃的监听事件 阻塞式
-            _poller.Poll(&activeChannels);
-            //遍歷活躍的channel
-            for(auto& channel : activeChannels)
+            _activeChannels.clear();
+            ApplyDirtyEvents();
+            //监听活跃的监听事件 阻塞到最早的定时器到期
+            int timeout = _timerWheel.PollTimeout();
+            LoadBeforePoll();
+            if(_spinMaxNs > 0 && timeout != 0) BusyPoll(timeout);
+            else _poller.Poll(&_activeChannels, timeout);
+            LoadAfterPoll();
+            //遍歷活躍的channel，处理过程中被移除的channel会被置空
+            for(_activeIndex = 0; _activeIndex < _activeChannels.size(); _activeIndex++)
             {
-                channel->HandleEvent();
+                Channel* channel = _activeChannels[_activeIndex];
+                if(channel) channel->HandleEvent();
             }
+            _activeIndex = 0;
+            _activeChannels.clear();
 
+            //IO事件处理完再执行到期的定时器
+            _timerWheel.RunOnTime(_pollTime);
             RunAllTask();
+            RunPendingFlush();
         }
         RunAllTask();
+        RunPendingFlush();
     }
 
-    void RunInLoop(const Functor& cb)
+    //在EventLoop线程中直接调用，不构造任务对象；其他线程投递到任务队列
+    template<class F>
+    void RunInLoop(F&& cb)
     {
         if(IsInLoop())
         {
@@ -131,28 +270,54 @@ public:
         }
         else
         {
-            QueueInLoop(cb);
+            QueueInLoop(std::forward<F>(cb));
         }
     }
 
-    void QueueInLoop(const Functor& cb)
+    void QueueInLoop(Functor cb)
     {
+        _task.Push(std::move(cb));
+        //只有第一个投递者写eventfd，EventLoop开始执行任务之前的其他投递不再重复唤醒
+        if(!_wakeup_pending.exchange(true))
         {
-            std::lock_guard<std::mutex> lock(_mutex);
-            _task.push_back(cb);
+            WakeUpEventfd();
         }
-        //唤醒当前线程
-        WakeUpEventfd();
     }
 
+    //延迟到本轮事件处理和任务执行完之后再执行，只能在EventLoop线程中调用
+    void QueueFlush(Functor cb)
+    {
+        AssertInLoop();
+        _pendingFlush.push_back(std::move(cb));
+    }
+
+    //只记录，Poll之前按净变化提交，同一轮先开后关不产生系统调用
     void UpdateEvent(Channel* channel)
     {
-        _poller.UpdateEvent(channel);
+        if(channel->MarkDirty())
+        {
+            _dirtyChannels.push_back(channel);
+        }
     }
 
+    //移除立即生效：之后描述符可能马上被关闭
     void RemoveEvent(Channel* channel)
     {
+        if(channel->Dirty())
+        {
+            channel->ClearDirty();
+            for(auto& ch : _dirtyChannels)
+            {
+                if(ch == channel) ch = nullptr;
+            }
+        }
         _poller.RemoveEvent(channel);
+        channel->Unregistered();
+        //本轮还没处理到的就绪事件作废，Channel随后可能被析构
+        for(size_t i = _activeIndex + 1; i < _activeChannels.size(); i++)
+        {
+            if(_activeChannels[i] == channel) _activeChannels[i] = nullptr;
+        }
     }
 
     bool IsInLoop()
@@ -171,6 +336,23 @@ public:
         _timerWheel.TimerAdd(id,delay,cb);
     }
 
+    //毫秒定时器：delay毫秒后执行一次，返回的id可用于TimerCancel，可在任意线程调用
+    uint64_t RunAfter(uint64_t delay_ms, const TaskFunc &cb)
+    {
+        uint64_t id = TIMER_AUTO_ID_BASE + _timerSeq.fetch_add(1, std::memory_order_relaxed);
+        _timerWheel.RunAfter(id, delay_ms, 0, cb);
+        return id;
+    }
+
+    //毫秒定时器：每隔interval毫秒执行一次，直到TimerCancel
+    uint64_t RunEvery(uint64_t interval_ms, const TaskFunc &cb)
+    {
+        if(interval_ms == 0) interval_ms = 1;
+        uint64_t id = TIMER_AUTO_ID_BASE + _timerSeq.fetch_add(1, std::memory_order_relaxed);
+        _timerWheel.RunAfter(id, interval_ms, interval_ms, cb);
+        return id;
+    }
+
     //取消定時任務
     void TimerCancel(uint64_t id)
     {
@@ -183,6 +365,70 @@ public:
         _timerWheel.TimerRefresh(id);
     }
 
+    //空闲检测定时器：节点由调用者持有，只能在EventLoop线程中调用
+    void IdleTimerStart(TimerNode* node, uint64_t timeout_ms)
+    {
+        _timerWheel.IdleStart(node, timeout_ms, _pollTime);
+    }
+
+    void IdleTimerStop(TimerNode* node)
+    {
+        _timerWheel.IdleStop(node);
+    }
+
+    //记录一次活动，不改动时间轮
+    void IdleTimerTouch(TimerNode* node)
+    {
+        TimerWheel::IdleTouch(node, _pollTime);
+    }
+
+    //读溢出区：只能在EventLoop线程中使用
+    char* ExtraBuffer() { return _extraBuf.data(); }
+    uint64_t ExtraBufferSize() const { return _extraBuf.size(); }
+
+    //缓冲区内存池：只能在EventLoop线程中使用
+    BufferPool* GetBufferPool() { return &_bufferPool; }
+
+    //最近的忙碌程度(千分比)，可在任意线程调用
+    //阻塞在Poll中超过一个窗口说明一直空闲，窗口还没来得及发布，直接返回0
+    uint32_t Load() const
+    {
+        uint64_t since = _pollSinceNs.load(std::memory_order_relaxed);
+        if(since != 0 && NowNs() - since >= LOOP_LOAD_WINDOW_NS)
+        {
+            return 0;
+        }
+        return _load.load(std::memory_order_relaxed);
+    }
+
+    //连接数：TcpServer分配连接时加一，连接移除时减一，可在任意线程调用
+    int ConnectionCount() const { return _connCount.load(std::memory_order_relaxed); }
+    void ConnectionAdded() { _connCount.fetch_add(1, std::memory_order_relaxed); }
+    void ConnectionRemoved() { _connCount.fetch_sub(1, std::memory_order_relaxed); }
+
+    //引用本循环的Connection对象数，包括已关闭但仍被使用者持有的、等待零拷贝完成通知的
+    //它们还会向本循环投递任务、归还内存池，归零之前循环不能销毁；可在任意线程调用
+    int ConnectionRefs() const { return _connRefs.load(std::memory_order_acquire); }
+    void RefConnection() { _connRefs.fetch_add(1, std::memory_order_relaxed); }
+    void UnrefConnection() { _connRefs.fetch_sub(1, std::memory_order_release); }
+
+    //附加在本循环上的数据，例如上层按loop划分的连接表；只在本循环线程中访问
+    void SetContext(const std::any& context) { _context = context; }
+    std::any* GetContext() { return &_context; }
+
+    //所在线程绑定的CPU及其NUMA节点，由创建线程在循环启动前设置
+    void SetCpu(int cpu, int node) { _cpu = cpu; _numaNode = node; }
+    int Cpu() const { return _cpu; }
+    int NumaNode() const { return _numaNode; }
+
+    //低延迟模式：每次阻塞等待之前先空转最多spin_us微秒，0表示关闭；只能在EventLoop线程中或Start之前调用
+    //空转占用所在的CPU，适合绑了核、对延迟敏感的loop
+    void EnableBusyPoll(uint64_t spin_us)
+    {
+        _spinMaxNs = spin_us * 1000;
+        _spinNs = _spinMaxNs;
+    }
+
     void Quit()
     {
         _quit.store(true, std::memory_order_relaxed);
@@ -213,17 +459,22 @@ inline void Channel::Update()
 //添加定時任務
 inline void TimerWheel::TimerAdd(uint64_t id,uint32_t delay, const TaskFunc &cb)
 {
-    _loop->RunInLoop(std::bind(&TimerWheel::TimerAddInLoop,this,id,delay,cb));
+    _loop->RunInLoop([this, id, delay, cb] { TimerAddInLoop(id, delay, cb); });
+}
+
+inline void TimerWheel::RunAfter(uint64_t id, uint64_t delay_ms, uint64_t interval_ms, const TaskFunc &cb)
+{
+    _loop->RunInLoop([this, id, delay_ms, interval_ms, cb] { RunAfterInLoop(id, delay_ms, interval_ms, cb); });
 }
 
 //取消定時任務
 inline void TimerWheel::TimerCancel(uint64_t id)
 {
-    _loop->RunInLoop(std::bind(&TimerWheel::TimerCancelInLoop,this,id));
+    _loop->RunInLoop([this, id] { TimerCancelInLoop(id); });
 }
 
 inline void TimerWheel::TimerRefresh(uint64_t id)
 {
-    _loop->RunInLoop(std::bind(&TimerWheel::TimerRefreshInLoop,this,id));
+    _loop->RunInLoop([this, id] { TimerRefreshInLoop(id); });
 }
 
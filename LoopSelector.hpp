@@ -0,0 +1,263 @@
+#pragma once
+#include "EventLoop.hpp"
+#include "CpuAffinity.hpp"
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+//新连接分配策略：在从属EventLoop中为新连接选一个
+//只在主线程(accept所在线程)调用，实现不需要加锁
+class LoopSelector {
+public:
+    virtual ~LoopSelector() {}
+
+    //loops非空；fd为新连接的描述符，可用于取对端地址等信息
+    virtual EventLoop* Select(const std::vector<EventLoop*>& loops, int fd) = 0;
+    //从属EventLoop集合变化后调用，需要预先计算的策略在这里重建
+    virtual void OnLoopsChanged(const std::vector<EventLoop*>& /*loops*/) {}
+};
+
+//轮询
+class RoundRobinSelector : public LoopSelector {
+public:
+    RoundRobinSelector():_next(0) {}
+
+    EventLoop* Select(const std::vector<EventLoop*>& loops, int /*fd*/) override
+    {
+        return loops[_next++ % loops.size()];
+    }
+
+private:
+    size_t _next;
+};
+
+//连接数最少：长连接负载不均时优先使用
+//连接构造时就计入所在loop，同一批新连接不会都落到同一个loop
+class LeastConnectionsSelector : public LoopSelector {
+public:
+    LeastConnectionsSelector():_next(0) {}
+
+    EventLoop* Select(const std::vector<EventLoop*>& loops, int /*fd*/) override
+    {
+        //起点轮转，连接数相同时依次分配
+        size_t n = loops.size();
+        size_t start = _next++ % n;
+        EventLoop* best = loops[start];
+        int best_cnt = best->ConnectionCount();
+        for(size_t i = 1; i < n && best_cnt > 0; i++)
+        {
+            EventLoop* loop = loops[(start + i) % n];
+            int cnt = loop->ConnectionCount();
+            if(cnt < best_cnt)
+            {
+                best = loop;
+                best_cnt = cnt;
+            }
+        }
+        return best;
+    }
+
+private:
+    size_t _next;
+};
+
+//最近负载最低：按各loop上一个统计窗口的忙碌时间占比选择
+/*
+    负载每个窗口(100ms)才更新一次，窗口内涌入的连接如果都选全局最低的会全部压到同一个loop
+    因此随机取两个比较，取负载低的(负载相同取连接少的)，既偏向空闲的loop又不会扎堆
+*/
+class LeastLoadSelector : public LoopSelector {
+public:
+    LeastLoadSelector():_seed(0x9E3779B97F4A7C15ULL) {}
+
+    EventLoop* Select(const std::vector<EventLoop*>& loops, int /*fd*/) override
+    {
+        size_t n = loops.size();
+        if(n == 1) return loops[0];
+        size_t a = Rand() % n;
+        size_t b = Rand() % (n - 1);
+        if(b >= a) b++;
+        EventLoop* la = loops[a];
+        EventLoop* lb = loops[b];
+        uint32_t load_a = la->Load();
+        uint32_t load_b = lb->Load();
+        if(load_a != load_b)
+        {
+            return load_a < load_b ? la : lb;
+        }
+        return la->ConnectionCount() <= lb->ConnectionCount() ? la : lb;
+    }
+
+private:
+    uint64_t Rand()
+    {
+        //xorshift64
+        _seed ^= _seed << 13;
+        _seed ^= _seed >> 7;
+        _seed ^= _seed << 17;
+        return _seed;
+    }
+
+    uint64_t _seed;
+};
+
+//一致性哈希：同一个键总是落在同一个loop，相关的客户端可以共用loop内的缓存
+//loop增减时只有约1/n的键改变归属
+class ConsistentHashSelector : public LoopSelector {
+public:
+    using KeyFunc = std::function<uint64_t(int fd)>;
+
+    //key默认取对端IP；replicas为每个loop在环上的虚拟节点数
+    explicit ConsistentHashSelector(KeyFunc key = PeerIpKey, int replicas = 160)
+        :_key(std::move(key)), _replicas(replicas < 1 ? 1 : replicas) {}
+
+    EventLoop* Select(const std::vector<EventLoop*>& loops, int fd) override
+    {
+        if(_ring.empty() || _loops != loops)
+        {
+            OnLoopsChanged(loops);
+        }
+        uint64_t h = Mix(_key(fd));
+        auto it = std::lower_bound(_ring.begin(), _ring.end(), std::make_pair(h, (size_t)0));
+        if(it == _ring.end()) it = _ring.begin();
+        return _loops[it->second];
+    }
+
+    void OnLoopsChanged(const std::vector<EventLoop*>& loops) override
+    {
+        _loops = loops;
+        _ring.clear();
+        _ring.reserve(loops.size() * _replicas);
+        for(size_t i = 0; i < loops.size(); i++)
+        {
+            //虚拟节点按loop地址生成，loop在集合中的位置变化不影响它在环上的位置
+            uint64_t base = Mix((uint64_t)(uintptr_t)loops[i]);
+            for(int r = 0; r < _replicas; r++)
+            {
+                _ring.emplace_back(Mix(base + r), i);
+            }
+        }
+        std::sort(_ring.begin(), _ring.end());
+    }
+
+    //对端IP(IPv4/IPv6)，取不到时返回描述符本身
+    static uint64_t PeerIpKey(int fd)
+    {
+        struct sockaddr_storage addr;
+        socklen_t len = sizeof(addr);
+        if(::getpeername(fd, (struct sockaddr*)&addr, &len) < 0)
+        {
+            return (uint64_t)fd;
+        }
+        if(addr.ss_family == AF_INET)
+        {
+            return ((struct sockaddr_in*)&addr)->sin_addr.s_addr;
+        }
+        if(addr.ss_family == AF_INET6)
+        {
+            const unsigned char* p = ((struct sockaddr_in6*)&addr)->sin6_addr.s6_addr;
+            uint64_t hi, lo;
+            memcpy(&hi, p, 8);
+            memcpy(&lo, p + 8, 8);
+            return hi ^ Mix(lo);
+        }
+        return (uint64_t)fd;
+    }
+
+private:
+    //splitmix64
+    static uint64_t Mix(uint64_t x)
+    {
+        x += 0x9E3779B97F4A7C15ULL;
+        x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+        return x ^ (x >> 31);
+    }
+
+    KeyFunc _key;
+    int _replicas;
+    std::vector<EventLoop*> _loops;
+    std::vector<std::pair<uint64_t, size_t>> _ring;    //(哈希值, loop下标)，按哈希值排序
+};
+
+//按收包CPU分配：新连接交给绑定在其SO_INCOMING_CPU上的loop，
+//没有时依次找同一物理核的超线程、同一NUMA节点上的loop，都没有或取不到时交给fallback
+//收包软中断和用户态处理在同一个核(或共享缓存的核)上，每个包不再有跨核的缓存行迁移
+//需要配合绑核(SetCpuPlacement/SetCpuAffinity)，网卡RSS把连接分散到与loop对应的各个核上时效果最好
+class IncomingCpuSelector : public LoopSelector {
+public:
+    explicit IncomingCpuSelector(std::unique_ptr<LoopSelector> fallback = std::make_unique<LeastConnectionsSelector>())
+        :_fallback(std::move(fallback)), _topology(CpuTopology::Detect()) {}
+
+    EventLoop* Select(const std::vector<EventLoop*>& loops, int fd) override
+    {
+        if(_loops != loops)
+        {
+            OnLoopsChanged(loops);
+        }
+        int cpu = _byCpu.empty() ? -1 : IncomingCpu(fd);
+        if(cpu >= 0)
+        {
+            EventLoop* loop = Pick(_byCpu, cpu);
+            for(size_t i = 0; loop == nullptr && i < _topology.Siblings(cpu).size(); i++)
+            {
+                loop = Pick(_byCpu, _topology.Siblings(cpu)[i]);
+            }
+            if(loop == nullptr) loop = Pick(_byNode, _topology.NodeOf(cpu));
+            if(loop != nullptr) return loop;
+        }
+        return _fallback->Select(loops, fd);
+    }
+
+    void OnLoopsChanged(const std::vector<EventLoop*>& loops) override
+    {
+        _loops = loops;
+        _byCpu.clear();
+        _byNode.clear();
+        for(EventLoop* loop : loops)
+        {
+            if(loop->Cpu() < 0) continue;//没有绑核
+            _byCpu[loop->Cpu()].push_back(loop);
+            _byNode[_topology.NodeOf(loop->Cpu())].push_back(loop);
+        }
+        _fallback->OnLoopsChanged(loops);
+    }
+
+    //最近处理该连接收包软中断的CPU，取不到返回-1
+    static int IncomingCpu(int fd)
+    {
+#ifdef SO_INCOMING_CPU
+        int cpu = -1;
+        socklen_t len = sizeof(cpu);
+        if(::getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) < 0) return -1;
+        return cpu;
+#else
+        return -1;
+#endif
+    }
+
+private:
+    //同一个CPU(节点)上有多个loop时取连接最少的
+    static EventLoop* Pick(const std::unordered_map<int, std::vector<EventLoop*>>& m, int key)
+    {
+        auto it = m.find(key);
+        if(it == m.end()) return nullptr;
+        EventLoop* best = nullptr;
+        for(EventLoop* loop : it->second)
+        {
+            if(best == nullptr || loop->ConnectionCount() < best->ConnectionCount()) best = loop;
+        }
+        return best;
+    }
+
+    std::unique_ptr<LoopSelector> _fallback;
+    CpuTopology _topology;
+    std::vector<EventLoop*> _loops;
+    std::unordered_map<int, std::vector<EventLoop*>> _byCpu;    //CPU -> 绑在上面的loop
+    std::unordered_map<int, std::vector<EventLoop*>> _byNode;   //NUMA节点 -> 绑在其中的loop
+};
@@ -1,13 +1,18 @@
 #pragma once
 #include "EventLoop.hpp"
+#include "CpuAffinity.hpp"
 #include <thread>
 #include <mutex>
 #include <condition_variable>
 
 class LoopThread {
 public:
-    LoopThread()
-        : _loop(nullptr),
+    // cpu >= 0 时线程先绑到该 CPU，node >= 0 时内存优先来自该节点，再创建 EventLoop
+    // 循环的溢出区、内存池和之后在本线程构造的连接都在绑定后首次访问，落在本地节点
+    explicit LoopThread(int cpu = -1, int node = -1)
+        : _cpu(cpu),
+          _node(node),
+          _loop(nullptr),
           _started(false),
           _stopped(false),
           _loop_thread(&LoopThread::ThreadEntry, this) {}
@@ -49,7 +54,10 @@ public:
 private:
     void ThreadEntry() {
         try {
+            bool pinned = _cpu >= 0 && PinCurrentThread(_cpu);
+            if (pinned && _node >= 0) PreferLocalMemory(_node);
             EventLoop loop; // 栈对象：生命周期覆盖整个线程
+            if (pinned) loop.SetCpu(_cpu, _node);
             {
                 std::lock_guard<std::mutex> lock(_mtx);
                 _loop = &loop;
@@ -81,11 +89,13 @@ private:
     }
 
 private:
+    int _cpu;
+    int _node;
     EventLoop* _loop;   
     bool _started;
     bool _stopped;
 
-    std::thread _loop_thread;//线程对象
     std::mutex _mtx;
     std::condition_variable _cond;
+    std::thread _loop_thread;//线程对象：必须最后构造，线程启动时互斥锁和条件变量已就绪
 };
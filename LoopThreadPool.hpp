@@ -1,6 +1,8 @@
 #pragma once
 #include "EventLoop.hpp"
 #include "LoopThread.hpp"
+#include "LoopSelector.hpp"
+#include <algorithm>
 #include <memory>
 #include <vector>
 #include <functional>
@@ -16,7 +18,8 @@ public:
         : _baseLoop(baseLoop)
         , _started(false)
         , _next(0)
-        , _threadCnt(0) {}
+        , _threadCnt(0)
+        , _placement(CpuPlacement::NONE) {}
 
     // 禁止拷贝/移动，避免多重管理线程
     LoopThreadPool(const LoopThreadPool&) = delete;
@@ -31,6 +34,28 @@ public:
         _threadCnt = (n < 0 ? 0 : n);
     }
 
+    // 子 loop 绑核：按拓扑自动选核，见 CpuPlacement；需在 Start 之前设置
+    // 每个 loop 绑一个 CPU，loop 多于 CPU 时依次复用；主线程（baseLoop）不绑定
+    void SetCpuPlacement(CpuPlacement placement) {
+        if (_started) return;
+        _placement = placement;
+    }
+
+    // 子 loop 绑核：依次使用给定的 CPU，优先于 SetCpuPlacement；需在 Start 之前设置
+    void SetCpuAffinity(std::vector<int> cpus) {
+        if (_started) return;
+        _cpuList = std::move(cpus);
+    }
+
+    // 绑核时检测到的 CPU 拓扑
+    const CpuTopology& Topology() const { return _topology; }
+
+    // 新连接分配策略，默认轮询；只在主线程调用
+    void SetLoopSelector(std::unique_ptr<LoopSelector> selector) {
+        _selector = std::move(selector);
+        if (_selector && _started && !_loops.empty()) _selector->OnLoopsChanged(_loops);
+    }
+
     void SetThreadInitCallback(ThreadInitCallback cb) {
         _initCb = std::move(cb);
     }
@@ -43,8 +68,13 @@ public:
         _threads.reserve(_threadCnt);
         _loops.reserve(_threadCnt);
 
+        if (!_cpuList.empty() || _placement != CpuPlacement::NONE) {
+            _topology = CpuTopology::Detect();
+            _cpus = !_cpuList.empty() ? _cpuList : _topology.Order(_placement);
+        }
+
         for (int i = 0; i < _threadCnt; ++i) {
-            auto th = std::make_unique<LoopThread>();
+            auto th = CreateThread();
             EventLoop* loop = th->GetLoop();       // 阻塞等子 loop 就绪
             
             if (_initCb) {
@@ -54,15 +84,48 @@ public:
             _threads.push_back(std::move(th));     // 拥有线程对象
         }
 
+        if (_selector && !_loops.empty()) _selector->OnLoopsChanged(_loops);
+
         // 单线程模式（0 个子线程）也可在 baseLoop 上执行 init
         if (_threadCnt == 0 && _initCb) {
             _baseLoop->RunInLoop([this]{ _initCb(_baseLoop); });
         }
     }
 
-    // Round-Robin 选择
-    EventLoop* NextLoop() {
+    // 运行期间增加一个子 loop，阻塞直到就绪；只在主线程调用，失败返回 nullptr
+    EventLoop* AddLoop() {
+        if (!_started) return nullptr;
+        auto th = CreateThread();
+        EventLoop* loop = th->GetLoop();
+        if (loop == nullptr) return nullptr;
+        if (_initCb) {
+            loop->RunInLoop([cb = _initCb, loop] { cb(loop); });
+        }
+        _loops.push_back(loop);
+        _threads.push_back(std::move(th));
+        if (_selector) _selector->OnLoopsChanged(_loops);
+        return loop;
+    }
+
+    // 把子 loop 移出分配集合并交出线程：之后不再分配新连接，线程继续运行
+    // 调用者处理完其上的连接后销毁返回值即停止线程；至少保留一个，找不到或只剩一个时返回 nullptr
+    std::unique_ptr<LoopThread> RemoveLoop(EventLoop* loop) {
+        if (_loops.size() <= 1) return nullptr;
+        auto it = std::find(_loops.begin(), _loops.end(), loop);
+        if (it == _loops.end()) return nullptr;
+        size_t idx = it - _loops.begin();
+        std::unique_ptr<LoopThread> th = std::move(_threads[idx]);
+        _loops.erase(it);
+        _threads.erase(_threads.begin() + idx);
+        if (_selector) _selector->OnLoopsChanged(_loops);
+        return th;
+    }
+
+    // 为新连接选择 loop：设置了策略时交给策略，否则 Round-Robin
+    // fd 为新连接描述符，策略可据此取对端地址
+    EventLoop* NextLoop(int fd = -1) {
         if (!_started || _loops.empty()) return _baseLoop;
+        if (_selector) return _selector->Select(_loops, fd);
         size_t idx = _next.fetch_add(1, std::memory_order_relaxed);
         return _loops[idx % _loops.size()];
     }
@@ -73,7 +136,7 @@ public:
         return _loops[hash % _loops.size()];
     }
 
-    // 返回所有可用 loops（若无子线程则仅 baseLoop）
+    // 返回所有可用 loops（若无子线程则仅 baseLoop）；运行期间增删后只在主线程读取
     std::vector<EventLoop*> GetAllLoops() const {
         if (_loops.empty()) return { _baseLoop };
         return _loops;
@@ -102,13 +165,36 @@ public:
     int Size() const { return static_cast<int>(_loops.size()); }
 
 private:
+    // 绑核时选当前 loop 最少的 CPU，按 _cpus 的顺序依次铺开
+    std::unique_ptr<LoopThread> CreateThread() {
+        if (_cpus.empty()) return std::make_unique<LoopThread>();
+        int cpu = _cpus[0];
+        int best = -1;
+        for (int c : _cpus) {
+            int n = 0;
+            for (auto* loop : _loops) n += (loop->Cpu() == c);
+            if (best < 0 || n < best) {
+                best = n;
+                cpu = c;
+            }
+        }
+        // 只有一个节点时不必设置内存策略
+        int node = _topology.Nodes().size() > 1 ? _topology.NodeOf(cpu) : -1;
+        return std::make_unique<LoopThread>(cpu, node);
+    }
+
     EventLoop* _baseLoop;                                    // 不拥有
     std::vector<std::unique_ptr<LoopThread>> _threads;       // 拥有从线程
     std::vector<EventLoop*> _loops;                          // 子 loops（观察指针）
     ThreadInitCallback _initCb{};
+    std::unique_ptr<LoopSelector> _selector;                 // 分配策略，空表示轮询
 
     std::atomic<size_t> _next;                               // 轮询计数
     int _threadCnt;
+    CpuPlacement _placement;
+    std::vector<int> _cpuList;                               // 用户指定的 CPU
+    std::vector<int> _cpus;                                  // 绑核使用的 CPU 顺序，空表示不绑
+    CpuTopology _topology;
     bool _started;
     mutable std::mutex _stopMtx;                             // 并发 Stop 保护
 };
@@ -3,16 +3,17 @@
 #include<sys/epoll.h>
 #include <unistd.h>
 #include <vector>
-#include<unordered_map>
 #include"Channel.hpp"
 #include"Log.hpp"
 using namespace log_ns;
 
-const uint64_t MAX_EPOLLEVENTS = 1024;
+const uint64_t INIT_EPOLLEVENTS = 64;       //事件数组初始大小
+const uint64_t MAX_EPOLLEVENTS = 65536;     //事件数组扩大的上限
+
 //添加修改刪除監控事件  
 class Poller {
 public:
-    Poller()
+    Poller():_events(INIT_EPOLLEVENTS)
     {
         _epfd = epoll_create1(EPOLL_CLOEXEC);
         if(_epfd < 0)
@@ -32,10 +33,17 @@ public:
     //添加或修改描述符事件监控
     void UpdateEvent(Channel* channel)
     {
-
-        if(_channels.count(channel->Fd()) == 0)
+        int fd = channel->Fd();
+        if(fd >= (int)_channels.size())
+        {
+            _channels.resize(fd + 1, nullptr);
+        }
+        if(_channels[fd] == nullptr)
         {
-            Update(channel,EPOLL_CTL_ADD);
+            if(Update(channel,EPOLL_CTL_ADD))
+            {
+                _channels[fd] = channel;
+            }
         }
         else
         {
@@ -45,61 +53,61 @@ public:
     //移除描述符事件监控
     bool RemoveEvent(Channel* channel)
     {
-         if(_channels.count(channel->Fd()) == 0)
-         {
+        int fd = channel->Fd();
+        if(fd >= (int)_channels.size() || _channels[fd] != channel)
+        {
             return false;
-         }
-         Update(channel,EPOLL_CTL_DEL);
-         _channels.erase(channel->Fd());
-         return true;
+        }
+        Update(channel,EPOLL_CTL_DEL);
+        _channels[fd] = nullptr;
+        return true;
     }
 
     //轮询描述符事件
-    //阻塞监控
+    //阻塞监控，最多等待timeout毫秒
     //返回一批活跃的描述符
-    void Poll(std::vector<Channel*>* activeChannels)
+    void Poll(std::vector<Channel*>* activeChannels, int timeout)
     {
-        int nfds = ::epoll_wait(_epfd,_events,MAX_EPOLLEVENTS,-1);
+        int nfds = ::epoll_wait(_epfd,_events.data(),(int)_events.size(),timeout);
         if(nfds < 0)
         {
-            if(errno == EINTR) return;\
+            if(errno == EINTR) return;
             LOG(ERROR,"epoll_wait error:%d(%s)",errno,strerror(errno));
             abort();
         }
 
         for(int i = 0;i < nfds; i++)
         {
-            Channel* channel = _channels[_events[i].data.fd];
+            //注册时data.ptr保存的就是Channel，不需要再查表
+            Channel* channel = static_cast<Channel*>(_events[i].data.ptr);
             //设置该Channel的活跃事件
             channel->SetRevents(_events[i].events);
             activeChannels->push_back(channel);
-
+        }
+        //本轮填满了事件数组，说明就绪的描述符可能更多，扩大一倍
+        if(nfds == (int)_events.size() && _events.size() < MAX_EPOLLEVENTS)
+        {
+            _events.resize(_events.size() * 2);
         }
     }
     
 
-    //移除描述符事件监控
 private:
-    void Update(Channel* channel,int op)
+    bool Update(Channel* channel,int op)
     {
         int fd = channel->Fd();
         struct epoll_event event;
-        event.data.fd = fd;
+        event.data.ptr = channel;
         event.events = channel->Events();
         if(epoll_ctl(_epfd,op,fd,&event) < 0)
         {
             LOG(ERROR,"epoll_ctl error:%d(%s)",errno,strerror(errno));
-            return;
-        }
-        if(_channels.count(fd) == 0)
-        {
-            _channels[fd] = channel;
+            return false;
         }
-        return;
+        return true;
     }
 
     int _epfd;
-    struct epoll_event _events[MAX_EPOLLEVENTS];
-    std::unordered_map<int, Channel*> _channels;
+    std::vector<struct epoll_event> _events;    //按需扩大，上限MAX_EPOLLEVENTS
+    std::vector<Channel*> _channels;            //按描述符下标，nullptr表示未注册
 };
-
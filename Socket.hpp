@@ -9,6 +9,11 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <linux/errqueue.h>
+#include <vector>
+#include <utility>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
@@ -19,7 +24,7 @@
 #include "Log.hpp"
 using namespace log_ns; // 避免头文件污染命名空间
 
-constexpr int DEFAULT_BACKLOG = 128;
+constexpr int DEFAULT_BACKLOG = SOMAXCONN; // 内核再按 net.core.somaxconn 截断
 
 class Socket {
 public:
@@ -121,6 +126,7 @@ public:
 
     // 返回“已连接 Socket”；可选拿到对端地址
     // 返回的 Socket 默认是 non-block & cloexec（Linux用 accept4）
+    // 失败返回 -1 时 errno 保留，调用者据此区分描述符耗尽等情况
     Socket Accept(InetAddr* peer = nullptr) {
         for (;;) {
 #ifdef __linux__
@@ -139,7 +145,14 @@ public:
                     // 非阻塞且无新连接
                     return Socket{-2}; // 约定：-2 表示“可重试/暂无”
                 }
-                LOG(ERROR, "accept() failed: %d(%s)", errno, strerror(errno));
+                int err = errno;
+                // 描述符耗尽和对端放弃由调用者处理，连接风暴时不逐个按错误打印
+                if (err == ECONNABORTED || err == EPROTO) {
+                    LOG(DEBUG, "accept() aborted: %d(%s)", err, strerror(err));
+                } else if (err != EMFILE && err != ENFILE) {
+                    LOG(ERROR, "accept() failed: %d(%s)", err, strerror(err));
+                }
+                errno = err;
                 return Socket{-1};
             }
 
@@ -208,9 +221,92 @@ public:
         }
     }
 
+    // Sendv：一次发送多段数据，返回值语义同 Send
+    ssize_t Sendv(const struct iovec* iov, int iovcnt, int flags = 0) {
+        assert(iov);
+        struct msghdr msg{};
+        msg.msg_iov = const_cast<struct iovec*>(iov);
+        msg.msg_iovlen = iovcnt;
+        for (;;) {
+            ssize_t n = ::sendmsg(_fd, &msg, flags);
+            if (n >= 0) return n;
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return -2;
+            LOG(ERROR, "sendmsg() failed: %d(%s)", errno, strerror(errno));
+            return -1;
+        }
+    }
+
+    // SendvZeroCopy：以 MSG_ZEROCOPY 发送，内核直接引用用户页，发送完成后经错误队列通知
+    //   返回值语义同 Send，另外 =-3 表示内核暂时无法锁定更多页(ENOBUFS)，应退回普通发送
+    ssize_t SendvZeroCopy(const struct iovec* iov, int iovcnt) {
+#ifdef MSG_ZEROCOPY
+        struct msghdr msg{};
+        msg.msg_iov = const_cast<struct iovec*>(iov);
+        msg.msg_iovlen = iovcnt;
+        for (;;) {
+            ssize_t n = ::sendmsg(_fd, &msg, MSG_DONTWAIT | MSG_ZEROCOPY);
+            if (n >= 0) return n;
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return -2;
+            if (errno == ENOBUFS) return -3;
+            LOG(ERROR, "sendmsg(MSG_ZEROCOPY) failed: %d(%s)", errno, strerror(errno));
+            return -1;
+        }
+#else
+        (void)iov; (void)iovcnt; return -3;
+#endif
+    }
+
+    // 读取错误队列中的零拷贝完成通知，每条通知是一段连续的发送序号 [lo, hi]
+    //   返回读到的通知条数；错误队列中没有零拷贝通知时返回 0
+    int ReadZeroCopyCompletions(std::vector<std::pair<uint32_t, uint32_t>>* ranges) {
+        int cnt = 0;
+        for (;;) {
+            char control[128];
+            struct msghdr msg{};
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            if (::recvmsg(_fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+                if (errno == EINTR) continue;
+                return cnt; // EAGAIN：错误队列已读空
+            }
+            for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+                if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                      (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))) continue;
+                auto* serr = reinterpret_cast<struct sock_extended_err*>(CMSG_DATA(cm));
+                if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+                ranges->emplace_back(serr->ee_info, serr->ee_data);
+                cnt++;
+            }
+        }
+    }
+
+    // 取出并清除套接字上挂起的错误
+    int PendingError() {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (::getsockopt(_fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) return errno;
+        return err;
+    }
+
+    // SendFile：从文件直接发送到套接字，不经过用户态；成功时推进 *offset
+    //   返回值语义同 Send
+    ssize_t SendFile(int in_fd, off_t* offset, size_t count) {
+        for (;;) {
+            ssize_t n = ::sendfile(_fd, in_fd, offset, count);
+            if (n >= 0) return n;
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return -2;
+            LOG(ERROR, "sendfile() failed: %d(%s)", errno, strerror(errno));
+            return -1;
+        }
+    }
+
     // 非阻塞便捷函数
     ssize_t NonBlockRecv(void* buf, size_t len) { return Recv(buf, len, MSG_DONTWAIT); }
     ssize_t NonBlockSend(const void* buf, size_t len) { return Send(buf, len, MSG_DONTWAIT); }
+    ssize_t NonBlockSendv(const struct iovec* iov, int iovcnt) { return Sendv(iov, iovcnt, MSG_DONTWAIT); }
 
     // ==== 设置选项 ====
     bool SetNonBlock(bool on = true) {
@@ -251,6 +347,47 @@ public:
 #endif
     }
 
+    // 设置 SO_ZEROCOPY，之后才能使用 MSG_ZEROCOPY 发送
+    bool SetZeroCopy(bool on = true) {
+#ifdef SO_ZEROCOPY
+        int opt = on ? 1 : 0;
+        if (::setsockopt(_fd, SOL_SOCKET, SO_ZEROCOPY, &opt, sizeof(opt)) < 0) {
+            LOG(WARNING, "setsockopt(SO_ZEROCOPY) failed: %d(%s)", errno, strerror(errno));
+            return false;
+        }
+        return true;
+#else
+        (void)on; return false;
+#endif
+    }
+
+    // 监听套接字设置 SO_INCOMING_CPU：SO_REUSEPORT 组内优先把在该 CPU 上收到的连接交给它（Linux 6.2 起）
+    bool SetIncomingCpu(int cpu) {
+#ifdef SO_INCOMING_CPU
+        if (::setsockopt(_fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) < 0) {
+            LOG(WARNING, "setsockopt(SO_INCOMING_CPU) failed: %d(%s)", errno, strerror(errno));
+            return false;
+        }
+        return true;
+#else
+        (void)cpu; return false;
+#endif
+    }
+
+    // 设置 SO_BUSY_POLL：接收队列为空时内核在驱动上轮询 usec 微秒再睡眠，需要网卡支持 NAPI
+    // 调高到 net.core.busy_read 以上需要 CAP_NET_ADMIN
+    bool SetBusyPoll(int usec) {
+#ifdef SO_BUSY_POLL
+        if (::setsockopt(_fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)) < 0) {
+            LOG(WARNING, "setsockopt(SO_BUSY_POLL) failed: %d(%s)", errno, strerror(errno));
+            return false;
+        }
+        return true;
+#else
+        (void)usec; return false;
+#endif
+    }
+
     // 设置 TCP_NODELAY，禁用 Nagle 算法
     bool SetNoDelay(bool on) {
         int opt = on ? 1 : 0;
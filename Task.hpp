@@ -0,0 +1,121 @@
+#pragma once
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+/*
+    任务类型：只能移动的无参可调用对象
+    捕获不超过TASK_INLINE_SIZE字节时直接存放在对象内部，不申请堆内存
+    std::function的内部存储只有16字节左右，捕获一个shared_ptr再加一个string就要申请堆内存
+*/
+const size_t TASK_INLINE_SIZE = 64;
+
+class Task
+{
+private:
+    //按可调用对象的类型生成的操作表
+    struct Ops
+    {
+        void (*_invoke)(void* obj);
+        void (*_move)(void* dst, void* src);   //移动到dst并析构src
+        void (*_destroy)(void* obj);
+    };
+
+    template<class F>
+    static constexpr bool IsInline()
+    {
+        return sizeof(F) <= TASK_INLINE_SIZE
+            && alignof(F) <= alignof(std::max_align_t)
+            && std::is_nothrow_move_constructible<F>::value;
+    }
+
+    //内部存放：对象直接构造在_storage中
+    template<class F>
+    struct InlineOps
+    {
+        static void Invoke(void* obj) { (*static_cast<F*>(obj))(); }
+        static void Move(void* dst, void* src)
+        {
+            F* f = static_cast<F*>(src);
+            new (dst) F(std::move(*f));
+            f->~F();
+        }
+        static void Destroy(void* obj) { static_cast<F*>(obj)->~F(); }
+        static constexpr Ops _ops = { Invoke, Move, Destroy };
+    };
+
+    //堆上存放：_storage中只保存指针
+    template<class F>
+    struct HeapOps
+    {
+        static F*& Ptr(void* obj) { return *static_cast<F**>(obj); }
+        static void Invoke(void* obj) { (*Ptr(obj))(); }
+        static void Move(void* dst, void* src) { *static_cast<F**>(dst) = Ptr(src); }
+        static void Destroy(void* obj) { delete Ptr(obj); }
+        static constexpr Ops _ops = { Invoke, Move, Destroy };
+    };
+
+    alignas(std::max_align_t) unsigned char _storage[TASK_INLINE_SIZE];
+    const Ops* _ops;
+
+    void Reset()
+    {
+        if(_ops)
+        {
+            _ops->_destroy(_storage);
+            _ops = nullptr;
+        }
+    }
+
+public:
+    Task():_ops(nullptr) {}
+
+    template<class F, class D = typename std::decay<F>::type,
+             class = typename std::enable_if<!std::is_same<D, Task>::value>::type>
+    Task(F&& f):_ops(nullptr)
+    {
+        if constexpr (IsInline<D>())
+        {
+            new (_storage) D(std::forward<F>(f));
+            _ops = &InlineOps<D>::_ops;
+        }
+        else
+        {
+            *reinterpret_cast<D**>(_storage) = new D(std::forward<F>(f));
+            _ops = &HeapOps<D>::_ops;
+        }
+    }
+
+    Task(Task&& other) noexcept:_ops(other._ops)
+    {
+        if(_ops)
+        {
+            _ops->_move(_storage, other._storage);
+            other._ops = nullptr;
+        }
+    }
+
+    Task& operator=(Task&& other) noexcept
+    {
+        if(this != &other)
+        {
+            Reset();
+            _ops = other._ops;
+            if(_ops)
+            {
+                _ops->_move(_storage, other._storage);
+                other._ops = nullptr;
+            }
+        }
+        return *this;
+    }
+
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+
+    ~Task() { Reset(); }
+
+    explicit operator bool() const { return _ops != nullptr; }
+
+    void operator()() { _ops->_invoke(_storage); }
+};
@@ -0,0 +1,108 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <utility>
+/*
+    多生产者单消费者无锁队列(Vyukov侵入式MPSC队列)
+    任意线程都可以Push，只有所属EventLoop线程可以消费
+    Push只有一次原子交换，不需要加锁
+*/
+template<class T>
+class MpscQueue
+{
+private:
+    struct Node
+    {
+        std::atomic<Node*> _next;
+        T _value;
+
+        Node():_next(nullptr) {}
+        explicit Node(T&& value):_next(nullptr), _value(std::move(value)) {}
+    };
+
+    std::atomic<Node*> _head;   //最后入队的节点，生产者竞争修改
+    Node* _tail;                //下一个出队的节点，只有消费者访问
+    Node _stub;                 //哨兵节点，队列为空时作为占位
+
+    void PushNode(Node* node)
+    {
+        node->_next.store(nullptr, std::memory_order_relaxed);
+        Node* prev = _head.exchange(node, std::memory_order_acq_rel);
+        //交换之后、链接之前，消费者看到的是断开的链表，会当作暂时为空
+        prev->_next.store(node, std::memory_order_release);
+    }
+
+    //取出一个节点，队列为空或者生产者尚未完成链接时返回nullptr
+    Node* PopNode()
+    {
+        Node* tail = _tail;
+        Node* next = tail->_next.load(std::memory_order_acquire);
+        if(tail == &_stub)
+        {
+            if(next == nullptr) return nullptr;
+            _tail = next;
+            tail = next;
+            next = next->_next.load(std::memory_order_acquire);
+        }
+        if(next != nullptr)
+        {
+            _tail = next;
+            return tail;
+        }
+        if(tail != _head.load(std::memory_order_acquire))
+        {
+            return nullptr;
+        }
+        //只剩最后一个节点：重新放入哨兵，使最后一个节点可以取出
+        PushNode(&_stub);
+        next = tail->_next.load(std::memory_order_acquire);
+        if(next != nullptr)
+        {
+            _tail = next;
+            return tail;
+        }
+        return nullptr;
+    }
+
+public:
+    MpscQueue():_head(&_stub), _tail(&_stub) {}
+    MpscQueue(const MpscQueue&) = delete;
+    MpscQueue& operator=(const MpscQueue&) = delete;
+
+    ~MpscQueue()
+    {
+        Node* node;
+        while((node = PopNode()) != nullptr)
+        {
+            delete node;
+        }
+    }
+
+    //任意线程调用
+    void Push(T value)
+    {
+        PushNode(new Node(std::move(value)));
+    }
+
+    //只能在消费者线程调用：取出调用时已经入队的元素依次交给cb
+    //执行过程中新入队的元素留到下一次，避免任务不断追加自身导致一直不返回
+    //last为哨兵时不能说明队列为空：PopNode放回哨兵时可能有生产者刚交换完还没链接，
+    //它的节点排在哨兵前面，这时取到哨兵为止
+    template<class F>
+    size_t ConsumeAll(F&& cb)
+    {
+        Node* last = _head.load(std::memory_order_acquire);
+        size_t cnt = 0;
+        Node* node;
+        while(!(last == &_stub && _tail == &_stub) && (node = PopNode()) != nullptr)
+        {
+            bool done = (node == last);
+            T value(std::move(node->_value));
+            delete node;
+            cb(value);
+            cnt++;
+            if(done) break;
+        }
+        return cnt;
+    }
+};
@@ -7,6 +7,8 @@
 #include <unordered_map>
 #include "Buffer.hpp"
 
+const int RETIRE_WAIT_MAX_MS = 1000;    //下线的loop等待连接对象放手时，再次检查的最长间隔
+
 class TcpServer {
     public:
     using PtrConnection = std::shared_ptr<Connection>;
@@ -14,82 +16,401 @@ class TcpServer {
     using MessageCallback = std::function<void(PtrConnection&, Buffer*)>;
     using ClosedCallback = std::function<void(PtrConnection&)>;
     using AnyEventCallback = std::function<void(PtrConnection&)>;
+    using WaterMarkCallback = std::function<void(PtrConnection&, size_t)>;
     private:
-        uint64_t _next_id;      //这是一个自动增长的连接ID，
+        std::atomic<uint64_t> _next_id;      //这是一个自动增长的连接ID，多监听模式下各从属线程同时分配
         int _port;
         int _timeout;           //这是非活跃连接的统计时间---多长时间无通信就是非活跃连接
         bool _enable_inactive_release;//是否启动了非活跃连接超时销毁的判断标志
+        bool _hugepage_buffers; //连接缓冲区内存池是否使用大页
+        size_t _high_water_mark; //连接输出缓冲区高水位，0表示不限制
+        size_t _low_water_mark;  //连接输出缓冲区低水位
+        bool _edge_triggered;    //监听套接字和连接是否使用边缘触发
+        size_t _io_budget;       //边缘触发下每次事件的读写预算
+        size_t _zerocopy_threshold; //连接零拷贝发送的最小字节数，0表示关闭
+        bool _reuse_port;        //每个从属EventLoop各自监听、各自accept
+        int _backlog;            //监听队列长度
+        int _accept_budget;      //每次可读事件最多接受的连接数
+        uint64_t _busy_poll_us;  //从属EventLoop阻塞前的空转上限，0表示关闭
+        int _socket_busy_poll_us;//连接的SO_BUSY_POLL，0表示不设置
         EventLoop _baseloop;    //这是主线程的EventLoop对象，负责监听事件的处理
-        Acceptor _acceptor;    //这是监听套接字的管理对象
+        std::vector<std::unique_ptr<Acceptor>> _acceptors;//监听套接字的管理对象，Start时创建；在线程池之后析构
+        //每个EventLoop一份：连接表只在该loop线程访问，待交接的描述符只在主线程访问
+        struct LoopSlot
+        {
+            EventLoop* _loop;
+            std::unordered_map<uint64_t, PtrConnection> _conns;//保存管理本loop所有连接对应的shared_ptr对象
+            std::vector<int> _pending;      //本轮accept、还没有交给loop的描述符
+            Acceptor* _acceptor;            //多监听模式下本loop的监听，否则为空
+            bool _retiring;                 //正在下线：不再分配新连接，连接迁完后停止线程
+            std::unique_ptr<LoopThread> _thread;//下线期间从线程池接管的线程
+
+            explicit LoopSlot(EventLoop* loop):_loop(loop), _acceptor(nullptr), _retiring(false) {}
+        };
+        std::unordered_map<EventLoop*, std::unique_ptr<LoopSlot>> _slots;//按loop创建和移除，只在主线程访问；在线程池之后析构，loop线程退出前一直可用
         LoopThreadPool _pool;   //这是从属EventLoop线程池
         
-        std::unordered_map<uint64_t, PtrConnection> _conns;//保存管理所有连接对应的shared_ptr对象
+        std::vector<LoopSlot*> _handoff;//本轮有待交接描述符的loop
+        Connection::PtrCallbacks _cbs;  //所有连接共用的回调，主线程生成
         ConnectedCallback _connected_callback;
         MessageCallback _message_callback;
         ClosedCallback _closed_callback;
         AnyEventCallback _event_callback;
+        WaterMarkCallback _high_water_callback;
+        WaterMarkCallback _low_water_callback;
     private:
         void RunAfterInLoop(const std::function<void()>& task, int delay)
         {
-            _next_id++;
-            _baseloop.TimerAdd(_next_id, delay, task);
+            _baseloop.TimerAdd(++_next_id, delay, task);
         }
 
-        //为新连接构造一个Connection进行管理
-        void NewConnection(int fd) {
-            _next_id++;
-            PtrConnection conn(new Connection(_pool.NextLoop(), _next_id, fd));
-            conn->SetMessageCallback(_message_callback);
-            conn->SetClosedCallback(_closed_callback);
-            conn->SetConnectedCallback(_connected_callback);
-            conn->SetAnyEventCallback(_event_callback);
-            conn->SetServerClosedCallback(std::bind(&TcpServer::RemoveConnection, this, std::placeholders::_1));
+        //在loop线程中构造Connection，先登记到本loop的连接表再就绪
+        //就绪时的连接回调中可能直接关闭连接，登记在后会留下已关闭的连接
+        void AddConnection(LoopSlot* slot, int fd, const Connection::PtrCallbacks& cbs) {
+            PtrConnection conn = std::make_shared<Connection>(slot->_loop, ++_next_id, fd);
+            conn->SetCallbacks(cbs);
+            conn->SetWaterMarks(_high_water_mark, _low_water_mark);
+            conn->SetEdgeTriggered(_edge_triggered, _io_budget);
+            if (_zerocopy_threshold > 0) conn->EnableZeroCopy(_zerocopy_threshold);
+            if (_socket_busy_poll_us > 0) conn->SetBusyPoll(_socket_busy_poll_us);
             if (_enable_inactive_release) conn->EnableInactiveRelease(_timeout);//启动非活跃超时销毁
+            slot->_conns.insert(std::make_pair(conn->Id(), conn));
             conn->Established();//就绪初始化
-            _conns.insert(std::make_pair(_next_id, conn));
         }
 
-        void RemoveConnectionInLoop(const PtrConnection &conn) {
-            int id = conn->Id();
-            auto it = _conns.find(id);
-            if (it != _conns.end()) {
-                _conns.erase(it);
+        //主线程accept到新连接：只选定loop并暂存描述符，本轮迭代结束时按loop成批交接
+        //每个loop每轮只有一个任务、一次唤醒，Connection在所属线程中构造
+        void NewConnection(int fd) {
+            EventLoop* loop = _pool.NextLoop(fd);
+            loop->ConnectionAdded();//选定时就计入，同一批后面的连接能看到
+            LoopSlot* slot = _slots.at(loop).get();
+            if (_handoff.empty()) {
+                _baseloop.QueueFlush([this] { FlushHandoff(); });
+            }
+            if (slot->_pending.empty()) {
+                _handoff.push_back(slot);
             }
+            slot->_pending.push_back(fd);
         }
 
-        //从管理Connection的_conns中移除连接信息
-        void RemoveConnection(const PtrConnection &conn) {
-            _baseloop.RunInLoop(std::bind(&TcpServer::RemoveConnectionInLoop, this, conn));
+        void FlushHandoff() {
+            for (LoopSlot* slot : _handoff) {
+                slot->_loop->RunInLoop([this, slot, cbs = ConnCallbacks(), fds = std::move(slot->_pending)] {
+                    for (int fd : fds) AddConnection(slot, fd, cbs);
+                });
+                slot->_pending.clear();
+            }
+            _handoff.clear();
+        }
+
+        //多监听模式：从属线程自己accept，连接直接在本线程构造登记，不经过主线程
+        void NewLocalConnection(LoopSlot* slot, int fd, const Connection::PtrCallbacks& cbs) {
+            slot->_loop->ConnectionAdded();
+            AddConnection(slot, fd, cbs);
+        }
+
+        //创建监听：多监听模式下每个从属EventLoop一个，否则只在主线程一个
+        void StartAcceptors() {
+            if (_reuse_port && _pool.Size() > 0) {
+                for (EventLoop* loop : _pool.GetAllLoops()) {
+                    StartLocalAcceptor(_slots.at(loop).get());
+                }
+                return;
+            }
+            auto acceptor = std::make_unique<Acceptor>(&_baseloop, _port, _backlog);
+            acceptor->SetEdgeTriggered(_edge_triggered);
+            acceptor->SetAcceptBudget(_accept_budget);
+            acceptor->SetAcceptCallback(std::bind(&TcpServer::NewConnection, this, std::placeholders::_1));
+            acceptor->Listen();//将监听套接字挂到baseloop上
+            _acceptors.push_back(std::move(acceptor));
+        }
+
+        //多监听模式下为一个从属loop创建监听
+        void StartLocalAcceptor(LoopSlot* slot) {
+            //回调在这里生成一次，从属线程只读
+            Connection::PtrCallbacks cbs = ConnCallbacks();
+            auto acceptor = std::make_unique<Acceptor>(slot->_loop, _port, _backlog);
+            acceptor->SetEdgeTriggered(_edge_triggered);
+            acceptor->SetAcceptBudget(_accept_budget);
+            //loop绑了核时，让内核把在这个核上收到的连接优先交给它
+            if (slot->_loop->Cpu() >= 0) acceptor->SetIncomingCpu(slot->_loop->Cpu());
+            acceptor->SetAcceptCallback([this, slot, cbs](int fd) { NewLocalConnection(slot, fd, cbs); });
+            Acceptor* acc = acceptor.get();
+            slot->_loop->RunInLoop([acc] { acc->Listen(); });
+            slot->_acceptor = acc;
+            _acceptors.push_back(std::move(acceptor));
+        }
+
+        //loop上记下自己的LoopSlot，连接关闭时在所属线程中直接找到连接表
+        //大页和忙轮询只用于从属线程：没有从属线程时loop就是负责accept的主线程，不改变它
+        LoopSlot* AddSlot(EventLoop* loop) {
+            LoopSlot* slot = (_slots[loop] = std::make_unique<LoopSlot>(loop)).get();
+            loop->RunInLoop([loop, slot] { loop->SetContext(slot); });
+            if (loop == &_baseloop) return slot;
+            if (_hugepage_buffers) {
+                loop->RunInLoop([loop] { loop->GetBufferPool()->EnableHugePage(); });
+            }
+            if (_busy_poll_us > 0) {
+                uint64_t us = _busy_poll_us;
+                loop->RunInLoop([loop, us] { loop->EnableBusyPoll(us); });
+            }
+            return slot;
+        }
+
+        //下线中的loop迁走一轮：在该loop线程中取出连接表，回到主线程为每个连接另选loop
+        //全部有结果后再来一轮，直到连接表为空；有连接没迁走(还在发送或正在关闭)时隔一会儿再来
+        void DrainLoop(LoopSlot* slot) {
+            slot->_loop->RunInLoop([this, slot] {
+                std::vector<PtrConnection> conns;
+                conns.reserve(slot->_conns.size());
+                for (auto& it : slot->_conns) conns.push_back(it.second);
+                _baseloop.RunInLoop([this, slot, conns = std::move(conns)] {
+                    if (conns.empty()) return FinishRetire(slot);
+                    auto round = std::make_shared<std::pair<size_t, bool>>(conns.size(), false);//(未完成数, 是否有失败)
+                    for (auto& conn : conns) {
+                        MigrateConnection(conn, _pool.NextLoop(conn->Fd()), [this, slot, round](bool ok) {
+                            if (!ok) round->second = true;
+                            if (--round->first > 0) return;
+                            if (round->second) {
+                                _baseloop.RunAfter(MIGRATE_RETRY_MS, [this, slot] { DrainLoop(slot); });
+                            } else {
+                                DrainLoop(slot);
+                            }
+                        });
+                    }
+                });
+            });
+        }
+
+        //连接表已空：再确认一次(可能有下线前发起的迁移刚落到这里)，
+        //并让该loop把排在前面的任务(包括转交给新loop的)执行完，然后停止线程并移除
+        //已关闭但仍被使用者持有、或在等待零拷贝完成通知的连接还会用到该loop，
+        //没有连接对象引用它之前线程保留，间隔逐次加倍地再检查
+        void FinishRetire(LoopSlot* slot, int wait_ms = MIGRATE_RETRY_MS) {
+            slot->_loop->RunInLoop([this, slot, wait_ms] {
+                bool empty = slot->_conns.empty();
+                _baseloop.RunInLoop([this, slot, empty, wait_ms] {
+                    if (!empty) return DrainLoop(slot);
+                    EventLoop* loop = slot->_loop;
+                    if (loop->ConnectionRefs() > 0) {
+                        _baseloop.RunAfter(wait_ms, [this, slot, wait_ms] {
+                            FinishRetire(slot, std::min(wait_ms * 2, RETIRE_WAIT_MAX_MS));
+                        });
+                        return;
+                    }
+                    slot->_thread.reset();//请求退出并join
+                    if (slot->_acceptor) {
+                        for (auto it = _acceptors.begin(); it != _acceptors.end(); ++it) {
+                            if (it->get() == slot->_acceptor) {
+                                _acceptors.erase(it);
+                                break;
+                            }
+                        }
+                    }
+                    _slots.erase(loop);
+                });
+            });
+        }
+
+        //连接共用的回调，只在主线程生成
+        Connection::PtrCallbacks ConnCallbacks() {
+            if (!_cbs) {
+                auto cbs = std::make_shared<Connection::Callbacks>();
+                cbs->_connected_cb = _connected_callback;
+                cbs->_message_cb = _message_callback;
+                cbs->_closed_cb = _closed_callback;
+                cbs->_any_event_cb = _event_callback;
+                cbs->_high_water_cb = _high_water_callback;
+                cbs->_low_water_cb = _low_water_callback;
+                //在连接所属线程中调用，从该loop的连接表中移除；迁移时连接换到新loop的表，回调不变
+                cbs->_server_closed_cb = [](PtrConnection& conn) {
+                    EventLoop* loop = conn->OwnerLoop();
+                    loop->ConnectionRemoved();
+                    std::any_cast<LoopSlot*>(*loop->GetContext())->_conns.erase(conn->Id());
+                };
+                _cbs = cbs;
+            }
+            return _cbs;
+        }
+
+        //回调改变后，之后建立的连接重新生成
+        void ResetCallbacks() { _cbs.reset(); }
+
+        //在slot的loop线程中调用：释放剩下的连接，连接表随之清空
+        static void ReleaseConnections(LoopSlot* slot) {
+            std::vector<PtrConnection> conns;
+            conns.reserve(slot->_conns.size());
+            for (auto& it : slot->_conns) conns.push_back(it.second);
+            for (auto& conn : conns) conn->Release();
         }
     public:
         TcpServer(int port):
             _port(port), 
             _next_id(0), 
             _enable_inactive_release(false), 
-            _acceptor(&_baseloop, port),
+            _hugepage_buffers(false),
+            _high_water_mark(0),
+            _low_water_mark(0),
+            _edge_triggered(false),
+            _io_budget(DEFAULT_IO_BUDGET),
+            _zerocopy_threshold(0),
+            _reuse_port(false),
+            _backlog(DEFAULT_BACKLOG),
+            _accept_budget(DEFAULT_ACCEPT_BUDGET),
+            _busy_poll_us(0),
+            _socket_busy_poll_us(0),
             _pool(&_baseloop) {
-            _acceptor.SetAcceptCallback(std::bind(&TcpServer::NewConnection, this, std::placeholders::_1));
-            _acceptor.Listen();//将监听套接字挂到baseloop上
+        }
+
+        //先在各loop线程中释放剩下的连接，连接对象在仍然存活的loop上析构；
+        //再停止全部从属线程(包括正在下线的)，之后LoopSlot才析构
+        //需在主线程的事件循环之外调用
+        ~TcpServer() {
+            for (auto& it : _slots) {
+                LoopSlot* slot = it.second.get();
+                slot->_loop->RunInLoop([slot] { ReleaseConnections(slot); });
+            }
+            _pool.Stop();
+            for (auto& it : _slots) it.second->_thread.reset();
         }
 
         void SetThreadCount(int count) { return _pool.SetThreadCount(count); }
 
+        //从属线程绑核：按NUMA拓扑自动分布，或依次使用给定的CPU；需在Start之前设置
+        //线程绑定后才创建EventLoop，内存池和在其中构造的连接都来自本地节点；主线程不绑定
+        void SetCpuPlacement(CpuPlacement placement) { _pool.SetCpuPlacement(placement); }
+        void SetCpuAffinity(std::vector<int> cpus) { _pool.SetCpuAffinity(std::move(cpus)); }
+
         //设置回调函数
-        void SetConnectedCallback(const ConnectedCallback&cb) { _connected_callback = cb; }
-        void SetMessageCallback(const MessageCallback&cb) { _message_callback = cb; }
-        void SetClosedCallback(const ClosedCallback&cb) { _closed_callback = cb; }
-        void SetAnyEventCallback(const AnyEventCallback&cb) { _event_callback = cb; }
+        //只影响之后建立的连接
+        void SetConnectedCallback(const ConnectedCallback&cb) { _connected_callback = cb; ResetCallbacks(); }
+        void SetMessageCallback(const MessageCallback&cb) { _message_callback = cb; ResetCallbacks(); }
+        void SetClosedCallback(const ClosedCallback&cb) { _closed_callback = cb; ResetCallbacks(); }
+        void SetAnyEventCallback(const AnyEventCallback&cb) { _event_callback = cb; ResetCallbacks(); }
+        void SetHighWaterMarkCallback(const WaterMarkCallback&cb) { _high_water_callback = cb; ResetCallbacks(); }
+        void SetLowWaterMarkCallback(const WaterMarkCallback&cb) { _low_water_callback = cb; ResetCallbacks(); }
+
+        //设置连接输出缓冲区高低水位：超过high暂停读取，回落到low恢复读取，high为0表示不限制
+        void SetWaterMarks(size_t high, size_t low) { _high_water_mark = high; _low_water_mark = low; }
+
+        //新连接分配到从属EventLoop的策略，默认轮询
+        //可选LeastConnectionsSelector、LeastLoadSelector、ConsistentHashSelector、IncomingCpuSelector或自定义
+        void SetLoopSelector(std::unique_ptr<LoopSelector> selector) { _pool.SetLoopSelector(std::move(selector)); }
 
         //设置非活跃超时销毁
         void EnableInactiveRelease(int timeout) { _timeout = timeout; _enable_inactive_release = true; }
 
         //添加一个定时任务
         void RunAfter(const std::function<void()>& task, int delay) {
-            _baseloop.RunInLoop(std::bind(&TcpServer::RunAfterInLoop, this, task, delay));
+            _baseloop.RunInLoop([this, task, delay] { RunAfterInLoop(task, delay); });
+        }
+
+        //边缘触发模式：accept和连接读写都一直处理到EAGAIN，budget为每次事件的读写字节上限
+        void EnableEdgeTrigger(bool on = true, size_t budget = DEFAULT_IO_BUDGET) {
+            _edge_triggered = on;
+            _io_budget = budget;
+        }
+
+        //多监听模式：每个从属EventLoop各自创建SO_REUSEPORT监听套接字并在本线程accept，
+        //由内核把新连接分散到各个套接字，连接建立速率不再受限于主线程；需在Start之前设置
+        //此模式下连接的分配由内核决定，SetLoopSelector不起作用；回调需在Start之前设置
+        //没有从属线程时仍由主线程监听
+        void EnableReusePort(bool on = true) { _reuse_port = on; }
+
+        //监听队列长度，内核再按net.core.somaxconn截断；需在Start之前设置
+        //重连风暴时队列太短会丢弃SYN，客户端要等重传超时
+        void SetBacklog(int backlog) { _backlog = backlog; }
+
+        //每次可读事件最多接受的连接数，需在Start之前设置
+        void SetAcceptBudget(int budget) { _accept_budget = budget; }
+
+        //大块发送使用MSG_ZEROCOPY：一次发送不少于threshold字节时由内核直接引用缓冲区，0表示关闭
+        //小块数据的页锁定和完成通知开销大于拷贝，threshold建议不低于几十KB
+        void EnableZeroCopy(size_t threshold) { _zerocopy_threshold = threshold; }
+
+        //从属EventLoop的连接缓冲区内存池使用大页，没有从属线程时不生效；需在Start之前设置
+        void EnableHugePageBuffers(bool on = true) { _hugepage_buffers = on; }
+
+        //低延迟模式：从属EventLoop每次阻塞等待前先空转最多spin_us微秒，空闲时空转预算自动减半直到不再空转
+        //socket_us>0时连接再设置SO_BUSY_POLL，内核在驱动上轮询，需要权限，设置失败时只打一次日志并放弃
+        //空转会占满所在CPU，建议同时绑核；没有从属线程时主线程不空转；需在Start之前设置
+        void EnableBusyPoll(uint64_t spin_us, int socket_us = 0) {
+            _busy_poll_us = spin_us;
+            _socket_busy_poll_us = socket_us;
         }
 
         //启动服务器
-        void Start() { _pool.Start();  _baseloop.Start(); }
+        void Start() {
+            if (_socket_busy_poll_us > 0) {
+                Socket probe;
+                if (!probe.Create() || !probe.SetBusyPoll(_socket_busy_poll_us)) _socket_busy_poll_us = 0;
+            }
+            _pool.Start();
+            for (EventLoop* loop : _pool.GetAllLoops()) {
+                AddSlot(loop);
+            }
+            StartAcceptors();
+            _baseloop.Start();
+        }
+
+        //以下运行期间的调整只在主线程调用，例如放在RunAfter的任务中
+
+        //当前分配新连接的从属EventLoop
+        std::vector<EventLoop*> Loops() const { return _pool.GetAllLoops(); }
+
+        //增加一个从属EventLoop，新连接随即可以分配过去；没有从属线程(SetThreadCount(0))时不支持，返回nullptr
+        EventLoop* AddLoop() {
+            if (_pool.Size() == 0) return nullptr;
+            EventLoop* loop = _pool.AddLoop();
+            if (loop == nullptr) return nullptr;
+            LoopSlot* slot = AddSlot(loop);
+            if (_reuse_port) StartLocalAcceptor(slot);
+            return loop;
+        }
 
-        size_t ConnectionCount() const { return _conns.size(); }
+        //下线一个从属EventLoop：不再分配新连接，已有连接按分配策略迁移到其余loop，迁完后线程退出
+        //数据迟迟发不完的连接会反复重试，线程保留到它们迁走或关闭；至少保留一个，失败返回false
+        //使用者仍持有的已关闭连接放手之前，线程也一直保留，之后对它的调用不会落到已销毁的loop上
+        //多监听模式下先关闭它的监听套接字
+        bool RetireLoop(EventLoop* loop) {
+            std::unique_ptr<LoopThread> th = _pool.RemoveLoop(loop);
+            if (!th) return false;
+            LoopSlot* slot = _slots.at(loop).get();
+            slot->_retiring = true;
+            slot->_thread = std::move(th);
+            //本轮已选中它的描述符先交过去，随后一起迁走
+            if (!_handoff.empty()) FlushHandoff();
+            if (slot->_acceptor) {
+                Acceptor* acc = slot->_acceptor;
+                loop->RunInLoop([acc] { acc->Stop(); });
+            }
+            DrainLoop(slot);
+            return true;
+        }
+
+        //把连接迁移到target(需是正在分配新连接的loop)，done(是否成功)在主线程调用
+        //可用于把过载loop上的热点连接挪走，迁移哪些连接由使用者按自己的统计决定
+        void MigrateConnection(const PtrConnection& conn, EventLoop* target, const std::function<void(bool)>& done = nullptr) {
+            auto it = _slots.find(target);
+            if (it == _slots.end() || it->second->_retiring) {
+                if (done) done(false);
+                return;
+            }
+            LoopSlot* to = it->second.get();
+            to->_loop->ConnectionAdded();//选定时就计入，与新连接一致
+            conn->MigrateTo(target, [this, to, done](PtrConnection& c, bool ok) {
+                //成功时在target线程：登记到它的连接表，关闭时从这里移除
+                if (!ok || !to->_conns.emplace(c->Id(), c).second) {
+                    to->_loop->ConnectionRemoved();//失败或者本来就在target
+                }
+                if (done) _baseloop.RunInLoop([done, ok] { done(ok); });
+            });
+        }
+
+        //各loop连接数之和，包括正在下线的loop
+        size_t ConnectionCount() const {
+            size_t cnt = 0;
+            for (auto& it : _slots) cnt += it.second->_loop->ConnectionCount();
+            return cnt;
+        }
 };
\ No newline at end of file
@@ -2,129 +2,330 @@
 #include <vector>
 #include <unordered_map>
 #include <cstdint>
+#include <cstring>
 #include <functional>
-#include <memory>
-#include <unistd.h>
-#include <sys/timerfd.h>
-#include"Channel.hpp"
+#include <time.h>
 #include"Log.hpp"
 using namespace log_ns;
-//定時器對象(秒級別)
+
+class EventLoop;
+
+//定時器對象(毫秒級別，分層時間輪)
+/*
+    第0层256个槽，每槽1毫秒；第1~4层各64个槽，每槽是下一层一整圈的时间
+    五层合计覆盖2^32毫秒(约49天)，更远的定时器先放在最高层，转到时再按剩余时间重新放置
+    定时器节点侵入式挂在槽的双向链表上，添加、取消都是O(1)
+    不占用描述符：EventLoop取最早到期时间作为Poll的超时，处理完IO事件后推进时间轮
+    没有定时器时Poll无限阻塞，空闲的线程不会被唤醒
+*/
 
 using TaskFunc = std::function<void()>;
-using ReleaseFunc = std::function<void()>;
-class TimerTask{
-    private:
-        uint64_t _id;       // 定时器任务对象ID
-        uint32_t _timeout;  //定时任务的超时时间
-        bool _canceled;     // false-表示没有被取消， true-表示被取消
-        TaskFunc _task_cb;  //定时器对象要执行的定时任务
-        ReleaseFunc _release; //用于删除TimerWheel中保存的定时器对象信息
-        
-    public:
-        TimerTask(uint64_t id, uint32_t delay, const TaskFunc &cb): 
-            _id(id), _timeout(delay), _task_cb(cb), _canceled(false) {}
-        ~TimerTask() { 
-            if (_canceled == false) _task_cb(); 
-            _release(); 
-        }
-        void Cancel() { _canceled = true; }
-        void SetRelease(const ReleaseFunc &cb) { _release = cb; }
-        uint32_t DelayTime() { return _timeout; }
+
+const int TIMER_LEVEL0_BITS = 8;
+const int TIMER_LEVELN_BITS = 6;
+const int TIMER_LEVELS = 5;
+const uint64_t TIMER_LEVEL0_SIZE = 1 << TIMER_LEVEL0_BITS;
+const uint64_t TIMER_LEVELN_SIZE = 1 << TIMER_LEVELN_BITS;
+const uint64_t TIMER_MAX_RANGE = ((uint64_t)1 << (TIMER_LEVEL0_BITS + (TIMER_LEVELS - 1) * TIMER_LEVELN_BITS)) - 1;
+const uint64_t TIMER_AUTO_ID_BASE = (uint64_t)1 << 63;  //RunAfter/RunEvery自动分配的id，和调用者指定的id分开
+
+//单调时钟，毫秒
+inline uint64_t NowMs()
+{
+    struct timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+//单调时钟，纳秒
+inline uint64_t NowNs()
+{
+    struct timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct TimerLink
+{
+    TimerLink* _prev;
+    TimerLink* _next;
+
+    void Init() { _prev = _next = this; }
+    bool Empty() const { return _next == this; }
+};
+
+struct TimerNode : public TimerLink
+{
+    uint64_t _id;
+    uint64_t _expire;       //到期时间(毫秒)
+    uint64_t _delay;        //定时时长，刷新时从当前时间重新计算
+    uint64_t _interval;     //重复间隔，0表示只执行一次
+    uint64_t _active;       //空闲检测：最后活跃时间，0表示普通定时器
+    int _level;             //所在层，用于计数
+    bool _canceled;         //回调执行期间被取消
+    bool _embedded;         //嵌在使用者对象中：不在id表中，不由时间轮释放
+    TaskFunc _task_cb;      //定时器对象要执行的定时任务
+
+    TimerNode():_id(0), _expire(0), _delay(0), _interval(0), _active(0),
+        _level(0), _canceled(false), _embedded(false)
+    {
+        Init();
+    }
 };
 
 class TimerWheel {
     private:
-        using WeakTask = std::weak_ptr<TimerTask>;
-        using PtrTask = std::shared_ptr<TimerTask>;
-        int _tick;      //当前的秒针，走到哪里释放哪里，释放哪里，就相当于执行哪里的任务
-        int _capacity;  //表盘最大数量---其实就是最大延迟时间
-        std::vector<std::vector<PtrTask>> _wheel;
-
+        uint64_t _current;      //已经处理到的时间，之前到期的定时器都已执行
+        TimerLink _level0[TIMER_LEVEL0_SIZE];
+        TimerLink _levels[TIMER_LEVELS - 1][TIMER_LEVELN_SIZE];
+        size_t _counts[TIMER_LEVELS];   //每层挂着的定时器个数
+        uint64_t _next;         //最早的到期时间，0表示没有定时器；取消和刷新不更新，只会提前唤醒一次
+        TimerNode* _running;    //正在执行回调的定时器
 
-        int timer_fd;
         EventLoop* _loop;
-        std::unique_ptr<Channel> _timer_channel;
 
-        std::unordered_map<uint64_t, WeakTask> _timers;
+        std::unordered_map<uint64_t, TimerNode*> _timers;
     private:
-        void RemoveTimer(uint64_t id) {
-            auto it = _timers.find(id);
-            if (it != _timers.end()) {
-                _timers.erase(it);
-            }
+        static int Shift(int level)
+        {
+            return level == 0 ? 0 : TIMER_LEVEL0_BITS + (level - 1) * TIMER_LEVELN_BITS;
+        }
+
+        static void Link(TimerLink* head, TimerLink* node)
+        {
+            node->_prev = head->_prev;
+            node->_next = head;
+            head->_prev->_next = node;
+            head->_prev = node;
+        }
+
+        static void Unlink(TimerLink* node)
+        {
+            node->_prev->_next = node->_next;
+            node->_next->_prev = node->_prev;
+            node->_prev = node->_next = node;
         }
 
-        //设置内核定时器
-        static int CreateTimerFd()
+        //按到期时间放入对应层的槽
+        //cascading为true时是在当前刻度处理之前转移下来的，正好当前到期的放入当前槽
+        void Insert(TimerNode* node, bool cascading = false)
         {
-            int timerfd = timerfd_create(CLOCK_MONOTONIC,0);
-            if(timerfd < 0)
+            uint64_t expire = node->_expire;
+            uint64_t earliest = cascading ? _current : _current + 1;
+            if(expire < earliest) expire = earliest;//已经到期的下一毫秒执行
+            uint64_t delta = expire - _current;
+            if(delta > TIMER_MAX_RANGE)
             {
-                LOG(ERROR,"CreateTimerFd error");
-                abort();
+                //超出范围：先放在最高层最远的位置，转到时重新放置
+                expire = _current + TIMER_MAX_RANGE;
+                delta = TIMER_MAX_RANGE;
             }
+            TimerLink* slot;
+            int level;
+            if(delta < TIMER_LEVEL0_SIZE)
+            {
+                level = 0;
+                slot = &_level0[expire & (TIMER_LEVEL0_SIZE - 1)];
+            }
+            else
+            {
+                level = 1;
+                while(level < TIMER_LEVELS - 1 && delta >= ((uint64_t)1 << Shift(level + 1)))
+                {
+                    level++;
+                }
+                slot = &_levels[level - 1][(expire >> Shift(level)) & (TIMER_LEVELN_SIZE - 1)];
+            }
+            node->_level = level;
+            _counts[level]++;
+            Link(slot, node);
+        }
 
+        void Remove(TimerNode* node)
+        {
+            _counts[node->_level]--;
+            Unlink(node);
+        }
 
-            struct itimerspec itime;
-            memset(&itime,0,sizeof(itime));
-            itime.it_value.tv_sec = 1;
-            itime.it_value.tv_nsec = 0;
-            itime.it_interval.tv_sec = 1;
-            itime.it_interval.tv_nsec = 0;
+        //高层的一个槽转到时，其中的定时器按剩余时间放到下面的层
+        void Cascade(int level)
+        {
+            TimerLink* slot = &_levels[level - 1][(_current >> Shift(level)) & (TIMER_LEVELN_SIZE - 1)];
+            TimerLink list;
+            list.Init();
+            if(slot->Empty()) return;
+            //整条链表转移出来再逐个放置，避免放回同一个槽
+            list._next = slot->_next;
+            list._prev = slot->_prev;
+            list._next->_prev = &list;
+            list._prev->_next = &list;
+            slot->Init();
+            while(!list.Empty())
+            {
+                TimerNode* node = static_cast<TimerNode*>(list._next);
+                Unlink(node);
+                _counts[level]--;
+                Insert(node, true);
+            }
+        }
 
-            if(timerfd_settime(timerfd,0,&itime,NULL) < 0)
+        //执行第0层当前槽中的定时器
+        void Expire()
+        {
+            TimerLink* slot = &_level0[_current & (TIMER_LEVEL0_SIZE - 1)];
+            while(!slot->Empty())
             {
-                LOG(ERROR,"timerfd_settime error");
-                abort();
+                TimerNode* node = static_cast<TimerNode*>(slot->_next);
+                Remove(node);
+                //空闲检测：期间有过活动，按最后活跃时间重新挂上
+                if(node->_active > 0 && node->_active + node->_delay > _current)
+                {
+                    node->_expire = node->_active + node->_delay;
+                    Insert(node);
+                    continue;
+                }
+                if(node->_embedded)
+                {
+                    //节点属于使用者，回调中可能随对象一起释放，之后不再访问
+                    node->_task_cb();
+                    continue;
+                }
+                if(node->_interval == 0)
+                {
+                    _timers.erase(node->_id);
+                }
+                _running = node;
+                node->_task_cb();
+                _running = nullptr;
+                if(node->_interval > 0 && !node->_canceled)
+                {
+                    node->_expire = _current + node->_interval;
+                    Insert(node);
+                }
+                else
+                {
+                    delete node;
+                }
             }
+        }
 
-            return timerfd;
+        //把时间推进到now，依次执行到期的定时器
+        void Advance(uint64_t now)
+        {
+            while(_current < now)
+            {
+                //低层都是空的：直接跳到下一次需要转动高层的位置
+                int level = 0;
+                while(level < TIMER_LEVELS && _counts[level] == 0) level++;
+                if(level == TIMER_LEVELS)
+                {
+                    _current = now;
+                    break;
+                }
+                if(level > 0)
+                {
+                    uint64_t skip = _current | (((uint64_t)1 << Shift(level)) - 1);
+                    if(skip >= now)
+                    {
+                        _current = now;
+                        break;
+                    }
+                    _current = skip;
+                }
+                _current++;
+                //第0层转完一圈，依次检查更高层是否也转完一圈
+                for(int l = 1; l < TIMER_LEVELS; l++)
+                {
+                    if((_current & (((uint64_t)1 << Shift(l)) - 1)) != 0) break;
+                    Cascade(l);
+                }
+                Expire();
+            }
         }
 
-        //读取内核定时器
-        int ReadTimerfd()
+        //最早需要处理的时间：第0层取第一个非空槽，高层取下一个非空槽转动的时间，0表示没有定时器
+        uint64_t NextExpire()
         {
-            uint64_t exp;
-            int ret = ::read(timer_fd,&exp,sizeof(exp));
-            if(ret < 0)
+            uint64_t next = 0;
+            if(_counts[0] > 0)
+            {
+                for(uint64_t t = _current + 1; t <= _current + TIMER_LEVEL0_SIZE; t++)
+                {
+                    if(!_level0[t & (TIMER_LEVEL0_SIZE - 1)].Empty())
+                    {
+                        next = t;
+                        break;
+                    }
+                }
+            }
+            for(int level = 1; level < TIMER_LEVELS; level++)
             {
-                if(errno == EINTR || errno == EAGAIN)
+                if(_counts[level] == 0) continue;
+                uint64_t base = _current >> Shift(level);
+                for(uint64_t n = 1; n <= TIMER_LEVELN_SIZE; n++)
                 {
-                    return 0;
+                    if(!_levels[level - 1][(base + n) & (TIMER_LEVELN_SIZE - 1)].Empty())
+                    {
+                        uint64_t t = (base + n) << Shift(level);
+                        if(next == 0 || t < next) next = t;
+                        break;
+                    }
                 }
-                LOG(ERROR,"ReadTimerfd error");
-                abort();
             }
-            return ret;
+            return next;
+        }
+
+        void AddNode(uint64_t id, uint64_t delay_ms, uint64_t interval_ms, const TaskFunc &cb)
+        {
+            TimerCancelInLoop(id);//同一个id重复添加时替换旧的定时器
+            TimerNode* node = new TimerNode;
+            node->_id = id;
+            node->_delay = delay_ms;
+            node->_expire = NowMs() + delay_ms;
+            node->_interval = interval_ms;
+            node->_task_cb = cb;
+            Insert(node);
+            _timers[id] = node;
+            if(_next == 0 || node->_expire < _next) _next = node->_expire;
         }
 
     public:
         TimerWheel(EventLoop* loop):
-         _tick(0),
-         _capacity(60),
-         _wheel(_capacity),
-         timer_fd(CreateTimerFd()),
-         _loop(loop),
-         _timer_channel(std::make_unique<Channel>(timer_fd, loop))
+         _current(NowMs()),
+         _next(0),
+         _running(nullptr),
+         _loop(loop)
         {
-            //註冊可讀事件保證每秒鐘執行一次
-            _timer_channel->SetReadCallback(std::bind(&TimerWheel::RunOnTime, this));
-            _timer_channel->EnableRead();
+            for(auto& slot : _level0) slot.Init();
+            for(auto& level : _levels)
+                for(auto& slot : level) slot.Init();
+            memset(_counts, 0, sizeof(_counts));
         }
-        
-        //定時器事件處理
-        void RunOnTime()
+
+        ~TimerWheel()
         {
-            ReadTimerfd();
-            RunTimerTask();
+            for(auto& it : _timers)
+            {
+                delete it.second;
+            }
+        }
+
+        //Poll的超时毫秒数：-1表示没有定时器，0表示已经有到期的
+        int PollTimeout()
+        {
+            if(_next == 0) return -1;
+            uint64_t now = NowMs();
+            if(_next <= now) return 0;
+            uint64_t wait = _next - now;
+            return wait > INT32_MAX ? INT32_MAX : (int)wait;
         }
-   
-        //这个函数应该每秒钟被执行一次，相当于秒针向后走了一步
-        void RunTimerTask()
+
+        //执行已经到期的定時任務，只能在EventLoop线程中调用
+        void RunOnTime(uint64_t now)
         {
-            _tick = (_tick + 1) % _capacity;
-            _wheel[_tick].clear();//清空指定位置的数组，就会把数组中保存的所有管理定时器对象的shared_ptr释放掉
+            if(_next == 0 || now < _next) return;
+            Advance(now);
+            _next = NextExpire();
         }
 
         //存在線程安全問題，只能在EventLoop線程中調用
@@ -138,29 +339,31 @@ class TimerWheel {
             return true;
         }
 
+        //delay单位为秒，为0时按1秒
         void TimerAddInLoop(uint64_t id, uint32_t delay, const TaskFunc &cb)
         {
             if(delay == 0) delay = 1;
+            AddNode(id, (uint64_t)delay * 1000, 0, cb);
+        }
 
-            PtrTask pt(new TimerTask(id, delay, cb));
-            pt->SetRelease(std::bind(&TimerWheel::RemoveTimer, this, id));
-            int pos = (_tick + delay) % _capacity;
-            _wheel[pos].push_back(pt);
-            _timers[id] = WeakTask(pt);
-        
+        //毫秒定时器，interval为0时只执行一次
+        void RunAfterInLoop(uint64_t id, uint64_t delay_ms, uint64_t interval_ms, const TaskFunc &cb)
+        {
+            AddNode(id, delay_ms, interval_ms, cb);
         }
-        //刷新/延迟定时任务
+
+        //刷新/延迟定时任务：从现在起重新计时
         void TimerRefreshInLoop(uint64_t id) {
-            //通过保存的定时器对象的weak_ptr构造一个shared_ptr出来，添加到轮子中
             auto it = _timers.find(id);
             if (it == _timers.end()) {
                 return;//没找着定时任务，没法刷新，没法延迟
             }
-            PtrTask pt = it->second.lock();//lock获取weak_ptr管理的对象对应的shared_ptr
-            if (!pt) return; // 对象已被释放，不能刷新
-            int delay = pt->DelayTime();
-            int pos = (_tick + delay) % _capacity;
-            _wheel[pos].push_back(pt);
+            TimerNode* node = it->second;
+            if(node == _running) return;
+            Remove(node);
+            node->_expire = NowMs() + node->_delay;
+            Insert(node);
+            if(_next == 0 || node->_expire < _next) _next = node->_expire;
         }
 
         void TimerCancelInLoop(uint64_t id) {
@@ -168,12 +371,45 @@ class TimerWheel {
             if (it == _timers.end()) {
                 return;//没找着定时任务，没法刷新，没法延迟
             }
-            PtrTask pt = it->second.lock();
-            if (pt) pt->Cancel();
-        } 
+            TimerNode* node = it->second;
+            _timers.erase(it);
+            if(node == _running)
+            {
+                node->_canceled = true;//回调返回后释放
+                return;
+            }
+            Remove(node);
+            delete node;
+        }
+
+        //空闲检测定时器，只能在EventLoop线程中调用
+        //节点嵌在使用者对象中，活动时只用IdleTouch记录时间，不改动时间轮
+        //到期时如果期间有过活动，按最后活跃时间重新挂上；连续timeout_ms没有活动才执行回调
+        void IdleStart(TimerNode* node, uint64_t timeout_ms, uint64_t now)
+        {
+            if(!node->Empty()) Remove(node);//已经挂在槽上
+            node->_embedded = true;
+            node->_delay = timeout_ms;
+            node->_active = now;
+            node->_expire = now + timeout_ms;
+            Insert(node);
+            if(_next == 0 || node->_expire < _next) _next = node->_expire;
+        }
+
+        void IdleStop(TimerNode* node)
+        {
+            if(!node->Empty()) Remove(node);
+        }
+
+        static void IdleTouch(TimerNode* node, uint64_t now)
+        {
+            node->_active = now;
+        }
 
         //添加定時任務
         void TimerAdd(uint64_t id, uint32_t delay, const TaskFunc &cb);
+        //毫秒定时任务
+        void RunAfter(uint64_t id, uint64_t delay_ms, uint64_t interval_ms, const TaskFunc &cb);
         //刷新/延迟定时任务
         void TimerRefresh(uint64_t id);
         //取消定時任務
@@ -1,5 +1,6 @@
 #pragma once
 #include<string>
+#include<cstdint>
 #include <unordered_map>
 
 class HttpResponse
@@ -11,11 +12,14 @@ private:
     std::unordered_map<std::string, std::string> _headers;
     std::string _body;
     std::string _redirect_url;
+    std::string _file_path;   //静态文件响应：正文由文件直接发送
+    uint64_t _file_size;
 public:
     HttpResponse(int code = 200):
     _code(code),
     _version("HTTP/1.1"),
-    _redirect_flag(false)
+    _redirect_flag(false),
+    _file_size(0)
     {}
 
     void Reset()
@@ -26,6 +30,8 @@ public:
         _headers.clear();
         _body.clear();
         _redirect_url.clear();
+        _file_path.clear();
+        _file_size = 0;
     }
 
     void SetVersion(std::string version)
@@ -48,6 +54,28 @@ public:
         _body = body;
     }
 
+    //以文件作为响应正文，发送时不读入内存
+    void SetFile(const std::string& path, uint64_t size)
+    {
+        _file_path = path;
+        _file_size = size;
+    }
+
+    bool HasFile() const
+    {
+        return !_file_path.empty();
+    }
+
+    const std::string& GetFilePath() const
+    {
+        return _file_path;
+    }
+
+    uint64_t GetFileSize() const
+    {
+        return _file_size;
+    }
+
     void SetRedirectUrl(std::string url)
     {
         _redirect_url = url;
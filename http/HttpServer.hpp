@@ -9,12 +9,15 @@
 #include <vector>
 #include <regex>
 #include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
 
 class HttpServer
 {
 public:
     using Handler = std::function<void(HttpRequest& req,HttpResponse* resp)>;
     using Handlers = std::vector<std::pair<std::regex, Handler>>;
+    using PtrConnection = TcpServer::PtrConnection;
 private:
     Handlers _get_route;
     Handlers _post_route;
@@ -64,9 +67,10 @@ private:
         }
 
         // 始终设置 Content-Length（即便为 0），避免在 keep-alive 下客户端等待数据而悬挂
-        resp->SetHeader("Content-Length", std::to_string(resp->GetBody().size()));
+        uint64_t content_length = resp->HasFile() ? resp->GetFileSize() : resp->GetBody().size();
+        resp->SetHeader("Content-Length", std::to_string(content_length));
 
-        if (resp->GetBody().empty() == false && resp->HasHeader("Content-Type") == false) {
+        if (content_length > 0 && resp->HasHeader("Content-Type") == false) {
             resp->SetHeader("Content-Type", "application/octet-stream");
         }
 
@@ -92,6 +96,17 @@ private:
         // 先将响应串落地，避免对临时对象取指针两次
         std::string out = rsp_str.str();
         conn->Send(out.data(), out.size());
+
+        // 文件正文由 sendfile 从页缓存直接发送，排在响应头之后
+        if (resp->HasFile() && req._method != "HEAD") {
+            int fd = ::open(resp->GetFilePath().c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0 || conn->SendFile(fd, 0, resp->GetFileSize()) == false) {
+                // 响应头已经发出，正文无法补齐，只能关闭连接
+                LOG(ERROR, "send file %s failed", resp->GetFilePath().c_str());
+                conn->Shutdown();
+            }
+            if (fd >= 0) ::close(fd);
+        }
     }
 
     bool IsFileHandler(const HttpRequest& req)
@@ -128,12 +143,14 @@ private:
             req_path += "index.html";
         }
 
-        bool ret = Util::ReadFile(req_path,&resp->GetBody());
-        std::cout << "file" << ' ' << resp->GetBody().size() << std::endl;
-        if(ret == false)
+        //只记录文件路径和大小，正文在发送时由sendfile直接从页缓存发出
+        std::error_code ec;
+        uintmax_t size = std::filesystem::file_size(req_path, ec);
+        if(ec)
         {
             return ;
         }
+        resp->SetFile(req_path, size);
 
         std::string mime = Util::ExtMime(req_path);
         resp->SetHeader("Content-Type",mime);
@@ -0,0 +1,79 @@
+//边缘触发 + 低高水位：同一轮先暂停读(高水位)再恢复读(低水位)，内核中剩下的请求不能被漏掉
+//客户端一次性流水线发送大量请求行，服务器逐行回显，全部收回才算通过
+#include"../TcpServer.hpp"
+#include<arpa/inet.h>
+#include<poll.h>
+#include<cstdio>
+#include<string>
+#include<thread>
+
+const int PORT = 8099;
+const size_t LINE_SIZE = 100;
+const size_t TOTAL = 40000 * LINE_SIZE;
+
+int main()
+{
+    std::thread server([] {
+        TcpServer* srv = new TcpServer(PORT);
+        srv->SetThreadCount(1);
+        srv->EnableEdgeTrigger(true);
+        srv->SetWaterMarks(1024, 0);
+        srv->SetMessageCallback([](TcpServer::PtrConnection& conn, Buffer* buf) {
+            conn->Send(buf->ReadPosition(), buf->ReadAbleSize());
+            buf->MoveReadOffset(buf->ReadAbleSize());
+        });
+        srv->Start();
+    });
+    server.detach();
+    usleep(200000);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(PORT);
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+    {
+        perror("connect");
+        return 1;
+    }
+
+    std::thread sender([fd] {
+        std::string line(LINE_SIZE - 1, 'x');
+        line += '\n';
+        std::string all;
+        while(all.size() < TOTAL) all += line;
+        size_t off = 0;
+        while(off < all.size())
+        {
+            ssize_t n = send(fd, all.data() + off, all.size() - off, 0);
+            if(n <= 0) return;
+            off += n;
+        }
+    });
+
+    size_t received = 0;
+    char buf[65536];
+    while(received < TOTAL)
+    {
+        struct pollfd pfd = {fd, POLLIN, 0};
+        if(poll(&pfd, 1, 5000) <= 0)
+        {
+            printf("FAIL: stalled after %zu of %zu bytes\n", received, TOTAL);
+            fflush(stdout);
+            _exit(1);
+        }
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if(n <= 0)
+        {
+            printf("FAIL: connection closed after %zu bytes\n", received);
+            fflush(stdout);
+            _exit(1);
+        }
+        received += n;
+    }
+    sender.join();
+    printf("OK: echoed %zu bytes\n", received);
+    fflush(stdout);
+    _exit(0);
+}
@@ -0,0 +1,61 @@
+//MpscQueue：消费者放回哨兵的同时，生产者刚交换完_head还没链接
+//按固定顺序重放这一交错：生产者的节点排在哨兵前面，_head指向哨兵，之后的ConsumeAll仍然要取出它们
+#include<atomic>
+#include<cstddef>
+#include<cstdio>
+#include<utility>
+#include<vector>
+#define private public
+#include"../TaskQueue.hpp"
+#undef private
+
+typedef MpscQueue<int> Queue;
+
+int Fail(const char* msg)
+{
+    printf("FAIL: %s\n", msg);
+    return 1;
+}
+
+int main()
+{
+    Queue q;
+    std::vector<int> got;
+    auto collect = [&got](int& v) { got.push_back(v); };
+
+    //生产者A入队，消费者越过哨兵，发现A是最后一个节点
+    q.Push(1);
+    Queue::Node* a = q._stub._next.load();
+    q._tail = a;
+    if(a != q._head.load()) return Fail("unexpected queue layout");
+
+    //生产者B交换_head，还没有把自己链接到A后面
+    Queue::Node* b = new Queue::Node(2);
+    Queue::Node* prev = q._head.exchange(b);
+
+    //消费者放回哨兵：哨兵排到B后面，A->_next仍为空，这一轮取不到节点
+    q.PushNode(&q._stub);
+    if(a->_next.load() != nullptr) return Fail("A linked too early");
+
+    //生产者B完成链接，此时_head指向哨兵，A和B都在哨兵前面
+    prev->_next.store(b);
+    if(q._head.load() != &q._stub) return Fail("head is not the stub");
+
+    size_t n = q.ConsumeAll(collect);
+    if(n != 2 || got.size() != 2 || got[0] != 1 || got[1] != 2) return Fail("stranded nodes not consumed");
+    if(q.ConsumeAll(collect) != 0) return Fail("queue not empty");
+
+    //执行过程中新入队的元素留到下一次
+    got.clear();
+    q.Push(3);
+    n = q.ConsumeAll([&q, &got](int& v) {
+        got.push_back(v);
+        q.Push(v + 1);
+    });
+    if(n != 1) return Fail("consumed past the snapshot");
+    while(q.ConsumeAll(collect) > 0) {}
+    if(got.size() != 2 || got[1] != 4) return Fail("self-pushed element lost");
+
+    printf("OK\n");
+    return 0;
+}
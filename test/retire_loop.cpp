@@ -0,0 +1,146 @@
+//下线loop时：使用者仍持有一个已关闭的连接，另一个连接的零拷贝发送还没完成
+//线程要保留到它们都放手，期间对已关闭连接的调用不能落到已销毁的loop上(配合-fsanitize=address)
+#include"../TcpServer.hpp"
+#include<arpa/inet.h>
+#include<poll.h>
+#include<cstdio>
+#include<fstream>
+#include<mutex>
+#include<string>
+#include<thread>
+#include<vector>
+
+const int PORT = 8098;
+const size_t PAYLOAD = 4 * 1024 * 1024;
+
+std::mutex mtx;
+std::vector<TcpServer::PtrConnection> conns;    //按建立顺序
+
+int ThreadCount()
+{
+    std::ifstream in("/proc/self/status");
+    std::string line;
+    while(std::getline(in, line))
+    {
+        if(line.compare(0, 8, "Threads:") == 0) return atoi(line.c_str() + 8);
+    }
+    return -1;
+}
+
+int Connect()
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(PORT);
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+    {
+        perror("connect");
+        _exit(1);
+    }
+    return fd;
+}
+
+void Fail(const char* msg)
+{
+    printf("FAIL: %s\n", msg);
+    fflush(stdout);
+    _exit(1);
+}
+
+//在主线程执行并等待完成
+void RunInBase(TcpServer* srv, const std::function<void()>& task)
+{
+    std::atomic<bool> done(false);
+    srv->RunAfter([&] { task(); done = true; }, 0);
+    while(!done) usleep(1000);
+}
+
+int main()
+{
+    std::atomic<TcpServer*> server(nullptr);
+    std::thread th([&server] {
+        TcpServer* srv = new TcpServer(PORT);
+        srv->SetThreadCount(2);
+        srv->EnableZeroCopy(64 * 1024);
+        srv->SetConnectedCallback([](TcpServer::PtrConnection& conn) {
+            std::lock_guard<std::mutex> lock(mtx);
+            conns.push_back(conn);
+        });
+        srv->SetMessageCallback([](TcpServer::PtrConnection& conn, Buffer* buf) {
+            std::string cmd(buf->ReadPosition(), buf->ReadAbleSize());
+            buf->MoveReadOffset(buf->ReadAbleSize());
+            if(cmd[0] == 'Z')
+            {
+                std::string payload(PAYLOAD, 'z');
+                conn->Send(payload.data(), payload.size());
+            }
+            conn->Shutdown();
+        });
+        server = srv;
+        srv->Start();
+    });
+    th.detach();
+    while(server == nullptr) usleep(1000);
+    TcpServer* srv = server;
+    usleep(200000);
+
+    //两个连接落在同一个loop上：轮询分配，第一个和第三个
+    int fds[3];
+    for(int i = 0; i < 3; i++)
+    {
+        fds[i] = Connect();
+        usleep(50000);
+    }
+    TcpServer::PtrConnection closed, sending;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if(conns.size() != 3 || conns[0]->GetLoop() != conns[2]->GetLoop()) Fail("unexpected loop assignment");
+        closed = conns[0];
+        sending = conns[2];
+        conns.clear();
+    }
+    EventLoop* loop = closed->GetLoop();
+
+    //第一个连接关闭，使用者继续持有；第三个发出大块零拷贝数据，客户端先不读
+    send(fds[0], "C", 1, 0);
+    send(fds[2], "Z", 1, 0);
+    usleep(200000);
+    if(closed->Connected()) Fail("connection not closed");
+
+    int threads = ThreadCount();
+    bool retired = false;
+    RunInBase(srv, [&] { retired = srv->RetireLoop(loop); });
+    if(!retired) Fail("RetireLoop refused");
+
+    //客户端读完全部数据：零拷贝完成后连接才真正关闭
+    size_t received = 0;
+    char buf[65536];
+    for(;;)
+    {
+        struct pollfd pfd = {fds[2], POLLIN, 0};
+        if(poll(&pfd, 1, 5000) <= 0) Fail("payload stalled");
+        ssize_t n = recv(fds[2], buf, sizeof(buf), 0);
+        if(n < 0) Fail("recv error");
+        if(n == 0) break;
+        received += n;
+    }
+    if(received != PAYLOAD) Fail("payload truncated");
+    sending.reset();
+
+    //还持有已关闭的连接：线程保留，对它的调用投递到仍然存活的loop
+    usleep(300000);
+    if(ThreadCount() != threads) Fail("loop thread stopped while a connection still references it");
+    closed->Send("x", 1);
+    closed->Shutdown();
+
+    //放手之后线程退出
+    closed.reset();
+    for(int i = 0; i < 300 && ThreadCount() != threads - 1; i++) usleep(10000);
+    if(ThreadCount() != threads - 1) Fail("loop thread not stopped after the last reference");
+
+    printf("OK\n");
+    fflush(stdout);
+    _exit(0);
+}